@@ -1,10 +1,27 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <linux/sched.h>
+
+#include "myshell.h"
 
 #define BUFFER_SIZE 1024
 #define MAX_ARGS 64
@@ -12,11 +29,89 @@
 #define HISTORY_SIZE 1000
 #define DELIMITERS " \t\r\n"
 #define SHELL_VERSION "1.0"
+#define ARENA_BLOCK_SIZE 4096
+#define VAR_BUCKETS 128
+#define ARITH_CACHE_SIZE 64
+#define ARITH_MAX_DEPTH 16
+#define TRACE_BUFFER_SIZE 65536
+#define TRACE_FLUSH_SIZE 32768
+#define TRACE_MAX_STRING 256
+#define TRACE_MAX_ARGS 32
+#define PARSE_CACHE_SIZE 32
+#define PARSE_CACHE_MAX_LINE 4096
+#define SCRIPT_CHUNK_SIZE (1 << 20)
+#define SCRIPT_RELEASE_SIZE (4 << 20)
+#define MULTIOS_PIPE_SIZE 65536
+#define JOB_STAT_COUNT 9
 
 #define OP_NONE 0
 #define OP_AND 1 // &&
 #define OP_OR 2  // ||
 
+#define TOK_WORD 0
+#define TOK_NEWLINE 1 // \n
+#define TOK_SEMI 2    // ;
+#define TOK_PIPE 3    // |
+#define TOK_AND 4     // &&
+#define TOK_OR 5      // ||
+#define TOK_EOF 6
+#define TOK_LPAREN 7 // (
+#define TOK_RPAREN 8 // )
+
+#define PARSE_OK MSH_PARSE_OK
+#define PARSE_INCOMPLETE MSH_PARSE_INCOMPLETE // more input lines needed
+#define PARSE_ERROR MSH_PARSE_ERROR
+
+#define COMPOUND_IF 1
+#define COMPOUND_FOR 2
+#define COMPOUND_WHILE 3
+#define COMPOUND_UNTIL 4
+#define COMPOUND_BRACE 5    // { list; }
+#define COMPOUND_SUBSHELL 6 // ( list )
+
+#define REDIR_IN 0     // [n]< file
+#define REDIR_OUT 1    // [n]> file
+#define REDIR_APPEND 2 // [n]>> file
+#define REDIR_DUP 3    // [n]>&m [n]<&m
+#define REDIR_CLOSE 4  // [n]>&- [n]<&-
+
+// fds 0-9 are the shell's; everything it opens for itself goes above them
+#define SHELL_FD_COUNT 10
+
+enum
+{
+    ARITH_NUM,
+    ARITH_VAR,
+    ARITH_NEG,
+    ARITH_NOT,
+    ARITH_BITNOT,
+    ARITH_PREINC,
+    ARITH_PREDEC,
+    ARITH_POSTINC,
+    ARITH_POSTDEC,
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_SHL,
+    ARITH_SHR,
+    ARITH_LT,
+    ARITH_LE,
+    ARITH_GT,
+    ARITH_GE,
+    ARITH_EQ,
+    ARITH_NE,
+    ARITH_BITAND,
+    ARITH_XOR,
+    ARITH_BITOR,
+    ARITH_AND,
+    ARITH_OR,
+    ARITH_TERNARY,
+    ARITH_ASSIGN, // value holds the operator of a compound assignment
+    ARITH_COMMA
+};
+
 // ANSI Color codes
 #define COLOR_RESET "\033[0m"
 #define COLOR_RED "\033[1;31m"
@@ -27,14 +122,50 @@
 #define COLOR_CYAN "\033[1;36m"
 #define COLOR_WHITE "\033[1;37m"
 
+extern char **environ;
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *head;
+} Arena;
+
+typedef struct
+{
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+typedef struct
+{
+    int type;
+    char *text;
+} Token;
+
+typedef struct Compound Compound;
+
+// A redirection of fd. Several files for one output fd all get the
+// output (multios).
+typedef struct
+{
+    int fd;
+    int type;     // REDIR_*
+    char *target; // file name, or the fd REDIR_DUP copies
+} Redirect;
+
 typedef struct
 {
     char **args;
-    char *stdin_file;
-    char *stdout_file;
-    char *stderr_file;
-    int stdout_append;
-    int stderr_append;
+    Redirect *redirs; // in the order given
+    int num_redirs;
+    Compound *compound;
 } Command;
 
 typedef struct
@@ -42,293 +173,3118 @@ typedef struct
     Command *commands;
     int num_commands;
     int operator;
+    int negate;
 } CommandGroup;
 
-// History storage
-char *history[HISTORY_SIZE];
-int history_count = 0;
+typedef struct
+{
+    CommandGroup *groups;
+    int num_groups;
+} CommandList;
 
-void print_banner(void)
+// if/for/while/until and groups; elif chains nest in else_body
+struct Compound
+{
+    int type;
+    CommandList *cond;
+    CommandList *body;
+    CommandList *else_body;
+    char *var;
+    char **words;
+    int needs_fork; // subshell body may change shell state
+};
+
+typedef struct
+{
+    Token *tokens;
+    int pos;
+    Arena *arena;
+    int status;
+} Parser;
+
+typedef struct Var
+{
+    struct Var *next;
+    char *name;
+    char *value;
+    int exported;
+} Var;
+
+typedef struct
+{
+    char **items;
+    int count;
+    int capacity;
+} WordList;
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+// What a redirection scope changed, for restore_redirections
+typedef struct
+{
+    int fds[SHELL_FD_COUNT];
+    FILE *out;
+    FILE *err;
+    unsigned int owned;   // ctx->owned_fds before the scope
+    unsigned int changed; // fds the scope redirected
+    pid_t copiers[SHELL_FD_COUNT]; // multios helpers, or 0
+} SavedFds;
+
+// One destination of a multios copier. All but the first are fed through
+// a relay pipe of their own.
+typedef struct
+{
+    int fd;
+    int relay[2];
+    int copy;       // splice refused (O_APPEND file, tty): use read/write
+    size_t pending; // bytes teed into relay this round
+} MultiosTarget;
+
+typedef struct
+{
+    char **args;
+    int pos;
+    int count;
+    int error;
+} TestState;
+
+typedef struct ArithNode
+{
+    int op;
+    long long value;
+    char *name;
+    struct ArithNode *left;
+    struct ArithNode *right;
+    struct ArithNode *third;
+} ArithNode;
+
+typedef struct
+{
+    const char *s;
+    size_t pos;
+    size_t len;
+    Arena *arena;
+    int error;
+} ArithParser;
+
+// Compiled $(( )) expressions, keyed by their text
+typedef struct
+{
+    char *expr;
+    size_t len;
+    unsigned int hash;
+    ArithNode *root; // NULL if the expression does not parse
+    Arena arena;
+    int busy;
+} ArithCacheEntry;
+
+// A previously parsed line. busy pins the entry while its commands run.
+typedef struct
+{
+    char *text;
+    size_t len;
+    unsigned int hash;
+    CommandList *list;
+    Arena arena;
+    unsigned long last_used;
+    int busy;
+} ParseCacheEntry;
+
+// Pending MYSHELL_TRACE records. Each process fills its own copy and only
+// whole records are written, so no locking is needed across forks.
+typedef struct
+{
+    int fd;
+    pid_t pid;
+    size_t len;
+    size_t record_start;
+    char data[TRACE_BUFFER_SIZE];
+} TraceBuffer;
+
+// Non-interactive input. Regular files are mapped whole, pipes are read
+// in large chunks; lines are split in place by overwriting the newline.
+typedef struct
+{
+    int fd;
+    int mapped;
+    int shared; // fd is the commands' stdin too
+    int eof;
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t pos;        // first byte not yet split off
+    size_t released;   // mapped bytes returned with MADV_DONTNEED
+    long mark;         // start of an incomplete construct, or -1
+    long terminated;   // newline a prefetch already overwrote, or -1
+} ScriptInput;
+
+// The transient cgroup v2 of the outermost pipeline ($MYSHELL_CGROUP).
+// The directory is only created once the pipeline forks.
+typedef struct
+{
+    int active; // this process is running a job's pipeline
+    int inside; // this process was forked into a job
+    int fd;     // the job's cgroup directory, or -1
+    char path[PATH_MAX];
+    char cpu_max[32]; // limits set by the limit builtin, or ""
+    char memory_max[32];
+} JobCgroup;
+
+// Resource totals of the last job, read just before its cgroup is removed
+typedef struct
+{
+    int valid;
+    char name[64];
+    long long values[JOB_STAT_COUNT]; // -1 where the controller is missing
+} JobStats;
+
+// One complete shell. Everything a running command can change lives
+// here, so separate contexts can run on separate threads.
+struct msh_ctx
+{
+    // History storage
+    char *history[HISTORY_SIZE];
+    int history_count;
+
+    // Shell variables and the status of the last pipeline ($?)
+    Var *vars[VAR_BUCKETS];
+    int shell_status;
+
+    // Pending break/continue levels and the current loop nesting
+    int loop_depth;
+    int pending_break;
+    int pending_continue;
+
+    // Expanded words live here for the duration of one command
+    Arena scratch;
+
+    // The shell's own pid ($$), which subshells keep reporting
+    pid_t pid;
+
+    // Set in forked children that run shell code instead of exec'ing
+    int in_subshell;
+    int interactive;
+
+    // Embedded contexts never exit() or chdir(); exiting stops the
+    // current msh_exec and cwd stands in for the process directory.
+    // Running out of memory unwinds to out_of_memory, set by the API call.
+    int embedded;
+    int exiting;
+    char *cwd;
+    jmp_buf *out_of_memory;
+
+    // Where commands read and write; out and err wrap fds[1] and fds[2].
+    // Unset or closed fds are -1. owned_fds has a bit for each fd the
+    // shell opened or duplicated itself and must close when replacing it;
+    // those are close-on-exec and, from 3 up, numbered above fd 9.
+    int fds[SHELL_FD_COUNT];
+    unsigned int owned_fds;
+    pid_t copiers[SHELL_FD_COUNT]; // multios helpers exec started, or 0
+    FILE *out;
+    FILE *err;
+
+    // $0 and the positional parameters $1..$N
+    char *script_name;
+    char **positional;
+    int positional_count;
+
+    // Lets the final command of a script replace the shell instead of forking
+    int tail_exec;
+
+    // Set when wait_status reaps a child a signal killed
+    int child_signaled;
+
+    // Script being run; its next line is parsed while children run
+    ScriptInput *script;
+    int prefetching;
+
+    // LRU cache of parsed lines so repeated input skips the lexer and parser
+    ParseCacheEntry parse_cache[PARSE_CACHE_SIZE];
+    unsigned long parse_cache_clock;
+
+    // Arithmetic expansion state
+    ArithCacheEntry arith_cache[ARITH_CACHE_SIZE];
+    int arith_depth;
+    int expansion_failed;
+
+    // set -x and the MYSHELL_TRACE event log
+    int xtrace;
+    TraceBuffer trace;
+
+    // Per-pipeline cgroups; cgroup_failed is a base that could not be used
+    JobCgroup job;
+    JobStats job_stats;
+    int cgroup_controllers;
+    char *cgroup_failed;
+};
+
+struct msh_program
+{
+    Arena arena;
+    CommandList *list;
+};
+
+// The context the calling thread is running commands in
+__thread msh_ctx *ctx = NULL;
+
+// Makes context current for the calling thread, returning the previous
+// one so API calls can nest (a builtin may drive another context)
+msh_ctx *enter_context(msh_ctx *context)
 {
-    printf("\n");
-    printf(COLOR_CYAN "╔════════════════════════════════════════════╗\n");
-    printf("║                                            ║\n");
-    printf("║        " COLOR_YELLOW "MyShell v%s" COLOR_CYAN "                      ║\n", SHELL_VERSION);
-    printf("║                                            ║\n");
-    printf("║  " COLOR_WHITE "A POSIX-compliant shell implementation" COLOR_CYAN "   ║\n");
-    printf("║  " COLOR_GREEN "Type 'help' for available commands" COLOR_CYAN "      ║\n");
-    printf("║                                            ║\n");
-    printf("╚════════════════════════════════════════════╝\n" COLOR_RESET);
-    printf("\n");
+    msh_ctx *previous = ctx;
+    ctx = context;
+    return previous;
 }
 
-void print_prompt(void)
+// perror() for the current context's stderr
+void shell_perror(const char *s)
 {
-    char cwd[BUFFER_SIZE];
-    char *user = getenv("USER");
-    char *home = getenv("HOME");
+    fprintf(ctx->err, "%s: %s\n", s, strerror(errno));
+}
 
-    if (getcwd(cwd, sizeof(cwd)) == NULL)
+void child_exit(int status);
+
+// Allocation failures end the shell, but only fail the current API call
+// of an embedded context; forked children just exit
+void out_of_memory(const char *what)
+{
+    shell_perror(what);
+    if (getpid() != ctx->pid)
     {
-        strcpy(cwd, "?");
+        child_exit(1);
     }
-
-    // Replace home directory with ~
-    if (home != NULL && strncmp(cwd, home, strlen(home)) == 0)
+    if (ctx->out_of_memory != NULL)
     {
-        char temp[BUFFER_SIZE];
-        snprintf(temp, sizeof(temp), "~%s", cwd + strlen(home));
-        strcpy(cwd, temp);
+        longjmp(*ctx->out_of_memory, 1);
     }
-
-    printf(COLOR_GREEN "%s" COLOR_RESET ":" COLOR_BLUE "%s" COLOR_RESET "$ ",
-           user ? user : "user", cwd);
-    fflush(stdout);
+    exit(1);
 }
 
-void add_to_history(const char *cmd)
+int execute(CommandList *list);
+int execute_pipeline(Command *commands, int num_commands);
+int builtin_memo(char **args);
+int builtin_limit(char **args);
+int builtin_cgstat(void);
+void command_from_argv(char **argv, Command *cmd);
+int write_all(int fd, const char *buf, size_t len);
+void close_fds(void);
+void script_prefetch(ScriptInput *in);
+const char *lookup_param(const char *name, char *buf, size_t buf_size);
+int arith_evaluate(const char *expr, size_t len, long long *result);
+
+void *arena_alloc(Arena *arena, size_t size)
 {
-    if (cmd == NULL || strlen(cmd) == 0)
-    {
-        return;
-    }
+    size = (size + 15) & ~(size_t)15;
 
-    if (history_count < HISTORY_SIZE)
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->used + size > block->size)
     {
-        history[history_count] = strdup(cmd);
-        if (history[history_count] != NULL)
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + cap);
+        if (block == NULL)
         {
-            history_count++;
+            out_of_memory("malloc");
         }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = cap;
+        arena->head = block;
     }
-    else
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t n)
+{
+    char *copy = arena_alloc(arena, n + 1);
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+void *arena_grow(Arena *arena, void *old, size_t old_size, size_t new_size)
+{
+    void *ptr = arena_alloc(arena, new_size);
+    if (old != NULL)
     {
-        free(history[0]);
-        for (int i = 0; i < HISTORY_SIZE - 1; i++)
-        {
-            history[i] = history[i + 1];
-        }
-        history[HISTORY_SIZE - 1] = strdup(cmd);
+        memcpy(ptr, old, old_size);
     }
+    return ptr;
 }
 
-void load_history(void)
+ArenaMark arena_mark(Arena *arena)
 {
-    char *home = getenv("HOME");
-    if (home == NULL)
+    ArenaMark mark = {arena->head, arena->head ? arena->head->used : 0};
+    return mark;
+}
+
+void arena_release(Arena *arena, ArenaMark mark)
+{
+    while (arena->head != NULL && arena->head != mark.block)
     {
-        return;
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
+    if (arena->head != NULL)
+    {
+        arena->head->used = mark.used;
+    }
+}
 
-    char path[BUFFER_SIZE];
-    snprintf(path, sizeof(path), "%s/.myshell_history", home);
+void arena_free(Arena *arena)
+{
+    ArenaMark empty = {NULL, 0};
+    arena_release(arena, empty);
+}
 
-    FILE *f = fopen(path, "r");
-    if (f == NULL)
+// Resolves a relative path against an embedded context's directory
+const char *shell_path(const char *path)
+{
+    if (ctx->cwd == NULL || path[0] == '/')
     {
-        return;
+        return path;
     }
 
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), f) != NULL && history_count < HISTORY_SIZE)
+    size_t len = strlen(ctx->cwd) + strlen(path) + 2;
+    char *full = arena_alloc(&ctx->scratch, len);
+    snprintf(full, len, "%s/%s", ctx->cwd, path);
+    return full;
+}
+
+void sb_append(StrBuf *sb, const char *s, size_t n)
+{
+    if (sb->len + n + 1 > sb->cap)
     {
-        line[strcspn(line, "\n")] = '\0';
-        if (strlen(line) > 0)
+        size_t cap = sb->cap ? sb->cap : 64;
+        while (cap < sb->len + n + 1)
         {
-            history[history_count] = strdup(line);
-            if (history[history_count] != NULL)
-            {
-                history_count++;
-            }
+            cap *= 2;
+        }
+        char *data = realloc(sb->data, cap);
+        if (data == NULL)
+        {
+            out_of_memory("realloc");
         }
+        sb->data = data;
+        sb->cap = cap;
     }
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
 
-    fclose(f);
+void sb_putc(StrBuf *sb, char c)
+{
+    sb_append(sb, &c, 1);
 }
 
-void save_history(void)
+void wordlist_push(WordList *wl, char *word)
 {
-    char *home = getenv("HOME");
-    if (home == NULL)
+    if (wl->count + 1 >= wl->capacity)
     {
-        return;
+        int capacity = wl->capacity ? wl->capacity * 2 : 8;
+        wl->items = arena_grow(&ctx->scratch, wl->items, wl->capacity * sizeof(char *),
+                               capacity * sizeof(char *));
+        wl->capacity = capacity;
     }
+    wl->items[wl->count++] = word;
+    wl->items[wl->count] = NULL;
+}
 
-    char path[BUFFER_SIZE];
-    snprintf(path, sizeof(path), "%s/.myshell_history", home);
-
-    FILE *f = fopen(path, "w");
-    if (f == NULL)
+unsigned int hash_string(const char *s)
+{
+    unsigned int hash = 2166136261u;
+    while (*s != '\0')
     {
-        perror("save_history");
-        return;
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    for (int i = 0; i < history_count; i++)
+Var *find_var(const char *name)
+{
+    for (Var *v = ctx->vars[hash_string(name) % VAR_BUCKETS]; v != NULL; v = v->next)
     {
-        fprintf(f, "%s\n", history[i]);
+        if (strcmp(v->name, name) == 0)
+        {
+            return v;
+        }
     }
+    return NULL;
+}
 
-    fclose(f);
+const char *get_var(const char *name)
+{
+    Var *v = find_var(name);
+    return v ? v->value : NULL;
 }
 
-void free_history(void)
+void set_var(const char *name, const char *value, int exported)
 {
-    for (int i = 0; i < history_count; i++)
+    Var *v = find_var(name);
+    if (v == NULL)
+    {
+        unsigned int bucket = hash_string(name) % VAR_BUCKETS;
+        v = calloc(1, sizeof(Var));
+        if (v == NULL || (v->name = strdup(name)) == NULL)
+        {
+            shell_perror("set_var");
+            free(v);
+            return;
+        }
+        v->next = ctx->vars[bucket];
+        ctx->vars[bucket] = v;
+    }
+
+    char *copy = strdup(value);
+    if (copy == NULL)
+    {
+        shell_perror("set_var");
+        return;
+    }
+    free(v->value);
+    v->value = copy;
+    if (exported)
     {
-        free(history[i]);
-        history[i] = NULL;
+        v->exported = 1;
     }
-    history_count = 0;
 }
 
-char **parse_line(char *line)
+void unset_var(const char *name)
 {
-    static char *args[MAX_ARGS];
-    static char tokens[MAX_ARGS][BUFFER_SIZE];
-    int arg_idx = 0;
-    int char_idx = 0;
-    int in_single_quote = 0;
-    int in_double_quote = 0;
-    int i = 0;
-
-    while (line[i] != '\0' && arg_idx < MAX_ARGS - 1)
+    Var **link = &ctx->vars[hash_string(name) % VAR_BUCKETS];
+    while (*link != NULL)
     {
-        char c = line[i];
-
-        if (c == '\'' && !in_double_quote)
+        Var *v = *link;
+        if (strcmp(v->name, name) == 0)
         {
-            in_single_quote = !in_single_quote;
-            i++;
-            continue;
+            *link = v->next;
+            free(v->name);
+            free(v->value);
+            free(v);
+            return;
         }
+        link = &v->next;
+    }
+}
 
-        if (c == '"' && !in_single_quote)
+void free_vars(void)
+{
+    for (int b = 0; b < VAR_BUCKETS; b++)
+    {
+        while (ctx->vars[b] != NULL)
         {
-            in_double_quote = !in_double_quote;
-            i++;
-            continue;
+            Var *v = ctx->vars[b];
+            ctx->vars[b] = v->next;
+            free(v->name);
+            free(v->value);
+            free(v);
         }
+    }
+}
 
-        if (c == '\\' && !in_single_quote)
+void init_vars(void)
+{
+    for (char **env = environ; *env != NULL; env++)
+    {
+        char *eq = strchr(*env, '=');
+        if (eq == NULL)
         {
-            char next = line[i + 1];
-
-            if (in_double_quote)
-            {
-                if (next == '"' || next == '\\')
-                {
-                    if (char_idx < BUFFER_SIZE - 1)
-                    {
-                        tokens[arg_idx][char_idx++] = next;
-                    }
-                    i += 2;
-                    continue;
-                }
-            }
-            else
-            {
-                if (next != '\0')
-                {
-                    if (char_idx < BUFFER_SIZE - 1)
-                    {
-                        tokens[arg_idx][char_idx++] = next;
-                    }
-                    i += 2;
-                    continue;
-                }
-            }
+            continue;
         }
-
-        if (!in_single_quote && !in_double_quote && (c == ' ' || c == '\t'))
+        char *name = strndup(*env, eq - *env);
+        if (name != NULL)
         {
-            if (char_idx > 0)
-            {
-                tokens[arg_idx][char_idx] = '\0';
-                args[arg_idx] = tokens[arg_idx];
-                arg_idx++;
-                char_idx = 0;
-            }
-            i++;
-            continue;
+            set_var(name, eq + 1, 1);
+            free(name);
         }
+    }
+}
 
-        if (char_idx < BUFFER_SIZE - 1)
+// Environment for a child about to exec; never freed since exec replaces the image
+char **build_envp(void)
+{
+    int count = 0;
+    for (int b = 0; b < VAR_BUCKETS; b++)
+    {
+        for (Var *v = ctx->vars[b]; v != NULL; v = v->next)
         {
-            tokens[arg_idx][char_idx++] = c;
+            count += v->exported;
         }
-        i++;
     }
 
-    if (char_idx > 0)
+    char **envp = malloc((count + 1) * sizeof(char *));
+    if (envp == NULL)
     {
-        tokens[arg_idx][char_idx] = '\0';
-        args[arg_idx] = tokens[arg_idx];
-        arg_idx++;
+        return environ;
     }
 
-    args[arg_idx] = NULL;
-    return args;
-}
-
-void parse_redirections(Command *cmd)
-{
-    cmd->stdin_file = NULL;
-    cmd->stdout_file = NULL;
-    cmd->stderr_file = NULL;
-    cmd->stdout_append = 0;
-    cmd->stderr_append = 0;
-
-    for (int i = 0; cmd->args[i] != NULL; i++)
+    int i = 0;
+    for (int b = 0; b < VAR_BUCKETS; b++)
     {
-        if (strcmp(cmd->args[i], "<") == 0)
-        {
-            if (cmd->args[i + 1] != NULL)
-            {
-                cmd->stdin_file = cmd->args[i + 1];
-                cmd->args[i] = NULL;
-            }
-        }
-        else if (strcmp(cmd->args[i], ">>") == 0 || strcmp(cmd->args[i], "1>>") == 0)
-        {
-            if (cmd->args[i + 1] != NULL)
-            {
-                cmd->stdout_file = cmd->args[i + 1];
-                cmd->stdout_append = 1;
-                cmd->args[i] = NULL;
-            }
-        }
-        else if (strcmp(cmd->args[i], ">") == 0 || strcmp(cmd->args[i], "1>") == 0)
+        for (Var *v = ctx->vars[b]; v != NULL; v = v->next)
         {
-            if (cmd->args[i + 1] != NULL)
+            if (!v->exported)
             {
-                cmd->stdout_file = cmd->args[i + 1];
-                cmd->stdout_append = 0;
-                cmd->args[i] = NULL;
+                continue;
             }
-        }
-        else if (strcmp(cmd->args[i], "2>>") == 0)
-        {
-            if (cmd->args[i + 1] != NULL)
+            size_t len = strlen(v->name) + strlen(v->value) + 2;
+            envp[i] = malloc(len);
+            if (envp[i] != NULL)
             {
-                cmd->stderr_file = cmd->args[i + 1];
-                cmd->stderr_append = 1;
-                cmd->args[i] = NULL;
+                snprintf(envp[i++], len, "%s=%s", v->name, v->value);
             }
         }
-        else if (strcmp(cmd->args[i], "2>") == 0)
+    }
+    envp[i] = NULL;
+    return envp;
+}
+
+int is_valid_name(const char *s, size_t len)
+{
+    if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_'))
+    {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++)
+    {
+        if (!(isalnum((unsigned char)s[i]) || s[i] == '_'))
         {
-            if (cmd->args[i + 1] != NULL)
-            {
-                cmd->stderr_file = cmd->args[i + 1];
-                cmd->stderr_append = 0;
-                cmd->args[i] = NULL;
-            }
+            return 0;
         }
     }
+    return 1;
 }
 
-int is_builtin(char *cmd)
+int is_assignment(const char *word)
+{
+    const char *eq = strchr(word, '=');
+    return eq != NULL && is_valid_name(word, eq - word);
+}
+
+long long now_us(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Writes every complete record and keeps any partial one buffered
+void trace_flush(void)
+{
+    size_t done = 0;
+
+    // Also runs from atexit, possibly with no context current
+    if (ctx == NULL || ctx->trace.fd < 0)
+    {
+        return;
+    }
+
+    while (done < ctx->trace.record_start)
+    {
+        ssize_t n = write(ctx->trace.fd, ctx->trace.data + done, ctx->trace.record_start - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+
+    memmove(ctx->trace.data, ctx->trace.data + ctx->trace.record_start, ctx->trace.len - ctx->trace.record_start);
+    ctx->trace.len -= ctx->trace.record_start;
+    ctx->trace.record_start = 0;
+}
+
+void trace_open(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        shell_perror(path);
+        return;
+    }
+
+    // Keep the log clear of the low fds that redirections use
+    ctx->trace.fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    if (ctx->trace.fd >= 0)
+    {
+        ctx->trace.pid = getpid();
+        atexit(trace_flush);
+    }
+}
+
+void trace_append(const char *s, size_t n)
+{
+    if (ctx->trace.len + n > TRACE_BUFFER_SIZE)
+    {
+        trace_flush();
+        if (ctx->trace.len + n > TRACE_BUFFER_SIZE)
+        {
+            n = TRACE_BUFFER_SIZE - ctx->trace.len;
+        }
+    }
+    memcpy(ctx->trace.data + ctx->trace.len, s, n);
+    ctx->trace.len += n;
+}
+
+void trace_printf(const char *format, ...)
+{
+    char buf[256];
+    va_list ap;
+
+    va_start(ap, format);
+    int n = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    if (n > 0)
+    {
+        trace_append(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+    }
+}
+
+// Appends s as a JSON string, cut at TRACE_MAX_STRING bytes
+void trace_json_string(const char *s)
+{
+    char buf[TRACE_MAX_STRING * 6 + 8];
+    size_t n = 0;
+
+    buf[n++] = '"';
+    for (size_t i = 0; s[i] != '\0' && i < TRACE_MAX_STRING; i++)
+    {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\')
+        {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        }
+        else if (c < 0x20)
+        {
+            n += snprintf(buf + n, 7, "\\u%04x", c);
+        }
+        else
+        {
+            buf[n++] = c;
+        }
+    }
+    buf[n++] = '"';
+    trace_append(buf, n);
+}
+
+void trace_begin(const char *event)
+{
+    ctx->trace.record_start = ctx->trace.len;
+    trace_printf("{\"ts\":%lld,\"pid\":%d,\"ev\":\"%s\"",
+                 now_us(CLOCK_REALTIME), (int)ctx->trace.pid, event);
+}
+
+void trace_string(const char *key, const char *value)
+{
+    trace_printf(",\"%s\":", key);
+    trace_json_string(value);
+}
+
+void trace_argv(char **argv)
+{
+    trace_append(",\"argv\":[", 9);
+    for (int i = 0; argv[i] != NULL && i < TRACE_MAX_ARGS; i++)
+    {
+        if (i > 0)
+        {
+            trace_append(",", 1);
+        }
+        trace_json_string(argv[i]);
+    }
+    trace_append("]", 1);
+}
+
+void trace_end(void)
+{
+    trace_append("}\n", 2);
+    ctx->trace.record_start = ctx->trace.len;
+    if (ctx->trace.len >= TRACE_FLUSH_SIZE)
+    {
+        trace_flush();
+    }
+}
+
+void sb_append_quoted(StrBuf *sb, const char *s)
+{
+    if (*s != '\0' && strspn(s, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                                "0123456789_./=:,+-@%") == strlen(s))
+    {
+        sb_append(sb, s, strlen(s));
+        return;
+    }
+
+    sb_putc(sb, '\'');
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '\'')
+        {
+            sb_append(sb, "'\\''", 4);
+        }
+        else
+        {
+            sb_putc(sb, *s);
+        }
+    }
+    sb_putc(sb, '\'');
+}
+
+// set -x: echoes a command to stderr after expansion, prefixed by $PS4
+void xtrace_print(WordList *assigns, char **args)
+{
+    const char *ps4 = get_var("PS4");
+    StrBuf line = {NULL, 0, 0};
+
+    if (ps4 == NULL)
+    {
+        ps4 = "+ ";
+    }
+    sb_append(&line, ps4, strlen(ps4));
+
+    for (int i = 0; i < assigns->count; i++)
+    {
+        const char *eq = strchr(assigns->items[i], '=');
+        char *name = arena_strndup(&ctx->scratch, assigns->items[i], eq - assigns->items[i]);
+        const char *value = get_var(name);
+
+        sb_append(&line, name, strlen(name));
+        sb_putc(&line, '=');
+        sb_append_quoted(&line, value ? value : "");
+        sb_putc(&line, ' ');
+    }
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        sb_append_quoted(&line, args[i]);
+        sb_putc(&line, ' ');
+    }
+
+    // The last word's separator becomes the newline; a line with no
+    // words (a bare redirection) just gets one after the prefix
+    if (assigns->count > 0 || args[0] != NULL)
+    {
+        line.data[line.len - 1] = '\n';
+    }
+    else
+    {
+        sb_putc(&line, '\n');
+    }
+    fputs(line.data, ctx->err);
+    free(line.data);
+}
+
+// Whether multios copiers exec started are still feeding files; the
+// shell has to outlive them rather than tail-exec
+int copiers_running(void)
+{
+    for (int n = 0; n < SHELL_FD_COUNT; n++)
+    {
+        if (ctx->copiers[n] > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Leaves a forked child without running atexit cleanup: flushing the
+// inherited stdin stream would rewind the parent's script input.
+void child_exit(int status)
+{
+    fflush(ctx->out);
+    fflush(ctx->err);
+    if (copiers_running())
+    {
+        close_fds();
+    }
+    trace_flush();
+    _exit(status);
+}
+
+// Where the cgroup stats come from; io.stat has a line per device
+static const struct
+{
+    const char *file;
+    const char *key;
+    const char *label;
+} job_stat_fields[JOB_STAT_COUNT] = {
+    {"cpu.stat", "usage_usec", "cpu.usage_usec"},
+    {"cpu.stat", "user_usec", "cpu.user_usec"},
+    {"cpu.stat", "system_usec", "cpu.system_usec"},
+    {"cpu.stat", "throttled_usec", "cpu.throttled_usec"},
+    {"memory.peak", NULL, "memory.peak"},
+    {"io.stat", "rbytes", "io.rbytes"},
+    {"io.stat", "wbytes", "io.wbytes"},
+    {"io.stat", "rios", "io.rios"},
+    {"io.stat", "wios", "io.wios"},
+};
+
+// $MYSHELL_CGROUP, unless it already turned out to be unusable
+const char *cgroup_base(void)
+{
+    const char *base = get_var("MYSHELL_CGROUP");
+
+    if (base == NULL || *base == '\0' ||
+        (ctx->cgroup_failed != NULL && strcmp(base, ctx->cgroup_failed) == 0))
+    {
+        return NULL;
+    }
+    return base;
+}
+
+int cgroup_write(int dir, const char *file, const char *value)
+{
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int result = write_all(fd, value, strlen(value));
+    close(fd);
+    return result;
+}
+
+void job_limit(const char *file, const char *value)
+{
+    if (value[0] != '\0' && cgroup_write(ctx->job.fd, file, value) != 0)
+    {
+        if (errno == ENOENT)
+        {
+            fprintf(ctx->err, "limit: %s: controller not enabled under %s\n",
+                    file, get_var("MYSHELL_CGROUP"));
+        }
+        else
+        {
+            fprintf(ctx->err, "limit: %s: %s\n", file, strerror(errno));
+        }
+    }
+}
+
+// Makes the running job's cgroup and applies its limits
+int job_create(void)
+{
+    const char *base = cgroup_base();
+
+    if (base == NULL)
+    {
+        return -1;
+    }
+    if (!ctx->cgroup_controllers)
+    {
+        // Needed for the limits and memory/io totals; without them only
+        // cpu.stat is available
+        int dir = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir >= 0)
+        {
+            cgroup_write(dir, "cgroup.subtree_control", "+cpu");
+            cgroup_write(dir, "cgroup.subtree_control", "+memory");
+            cgroup_write(dir, "cgroup.subtree_control", "+io");
+            close(dir);
+        }
+        ctx->cgroup_controllers = 1;
+    }
+
+    // Numbered process-wide: contexts on other threads share the pid
+    static unsigned int job_seq;
+    snprintf(ctx->job.path, sizeof(ctx->job.path), "%s/msh-%d-%u", base, (int)getpid(),
+             __atomic_add_fetch(&job_seq, 1, __ATOMIC_RELAXED));
+    if (mkdir(ctx->job.path, 0755) != 0 ||
+        (ctx->job.fd = open(ctx->job.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        fprintf(ctx->err, "cgroup: %s: %s; running jobs without one\n", base, strerror(errno));
+        rmdir(ctx->job.path);
+        free(ctx->cgroup_failed);
+        ctx->cgroup_failed = strdup(base);
+        return -1;
+    }
+
+    job_limit("cpu.max", ctx->job.cpu_max);
+    job_limit("memory.max", ctx->job.memory_max);
+    return 0;
+}
+
+// fork() that puts the child straight into the running job's cgroup.
+// clone3 does that atomically; embedded contexts share their process with
+// other threads and go through fork(), as does a kernel without it, and
+// the child then moves itself.
+pid_t job_fork(void)
+{
+    if (!ctx->job.active || (ctx->job.fd < 0 && job_create() != 0))
+    {
+        ctx->job.active = 0;
+        return fork();
+    }
+
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    if (!ctx->embedded)
+    {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = ctx->job.fd;
+
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0)
+        {
+            return pid;
+        }
+    }
+#endif
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        cgroup_write(ctx->job.fd, "cgroup.procs", "0");
+    }
+    return pid;
+}
+
+// Adds up every "key value" or "key=value" in a cgroup stat file
+long long cgroup_stat(int dir, const char *file, const char *key)
+{
+    char buf[4096];
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    long long total = -1;
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    buf[n] = '\0';
+    if (key == NULL)
+    {
+        return strtoll(buf, NULL, 10);
+    }
+
+    size_t key_len = strlen(key);
+    char *save;
+    for (char *word = strtok_r(buf, " \n", &save); word != NULL; word = strtok_r(NULL, " \n", &save))
+    {
+        if (strncmp(word, key, key_len) != 0)
+        {
+            continue;
+        }
+        char *value = word[key_len] == '=' ? word + key_len + 1 : NULL;
+        if (word[key_len] == '\0')
+        {
+            value = strtok_r(NULL, " \n", &save);
+        }
+        if (value != NULL)
+        {
+            total = (total < 0 ? 0 : total) + strtoll(value, NULL, 10);
+        }
+    }
+    return total;
+}
+
+// Records the job's totals and removes its cgroup. Everything in it has
+// been waited for; a leftover background process keeps it alive.
+void job_end(const char *name)
+{
+    if (ctx->job.fd >= 0)
+    {
+        if (name != NULL)
+        {
+            snprintf(ctx->job_stats.name, sizeof(ctx->job_stats.name), "%s", name);
+            for (int i = 0; i < JOB_STAT_COUNT; i++)
+            {
+                ctx->job_stats.values[i] = cgroup_stat(ctx->job.fd, job_stat_fields[i].file,
+                                                       job_stat_fields[i].key);
+            }
+            ctx->job_stats.valid = 1;
+        }
+        close(ctx->job.fd);
+        rmdir(ctx->job.path);
+    }
+    ctx->job.active = 0;
+    ctx->job.fd = -1;
+    ctx->job.cpu_max[0] = '\0';
+    ctx->job.memory_max[0] = '\0';
+}
+
+pid_t fork_child(void)
+{
+    // The child ends up on the process streams, which must not replay
+    // anything the embedding program left buffered
+    fflush(stdout);
+    fflush(stderr);
+    fflush(ctx->out);
+    fflush(ctx->err);
+
+    pid_t pid = job_fork();
+    if (pid == 0)
+    {
+        // The parent's copiers are not this child's to wait for
+        ctx->script = NULL;
+        memset(ctx->copiers, 0, sizeof(ctx->copiers));
+    }
+    if (pid == 0 && (ctx->job.active || ctx->job.inside))
+    {
+        // Nested pipelines stay in the job this child was placed in
+        if (ctx->job.fd >= 0)
+        {
+            close(ctx->job.fd);
+        }
+        ctx->job.active = 0;
+        ctx->job.inside = 1;
+        ctx->job.fd = -1;
+    }
+    if (pid == 0 && ctx->trace.fd >= 0)
+    {
+        // The parent still owns and will write the inherited records
+        ctx->trace.len = 0;
+        ctx->trace.record_start = 0;
+        ctx->trace.pid = getpid();
+    }
+    return pid;
+}
+
+void print_banner(void)
+{
+    fprintf(ctx->out, "\n");
+    fprintf(ctx->out, COLOR_CYAN "╔════════════════════════════════════════════╗\n");
+    fprintf(ctx->out, "║                                            ║\n");
+    fprintf(ctx->out, "║        " COLOR_YELLOW "MyShell v%s" COLOR_CYAN "                      ║\n", SHELL_VERSION);
+    fprintf(ctx->out, "║                                            ║\n");
+    fprintf(ctx->out, "║  " COLOR_WHITE "A POSIX-compliant shell implementation" COLOR_CYAN "   ║\n");
+    fprintf(ctx->out, "║  " COLOR_GREEN "Type 'help' for available commands" COLOR_CYAN "      ║\n");
+    fprintf(ctx->out, "║                                            ║\n");
+    fprintf(ctx->out, "╚════════════════════════════════════════════╝\n" COLOR_RESET);
+    fprintf(ctx->out, "\n");
+}
+
+void print_prompt(void)
+{
+    char cwd[BUFFER_SIZE];
+    const char *user = get_var("USER");
+    const char *home = get_var("HOME");
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        strcpy(cwd, "?");
+    }
+
+    // Replace home directory with ~
+    if (home != NULL && strncmp(cwd, home, strlen(home)) == 0)
+    {
+        char temp[BUFFER_SIZE];
+        snprintf(temp, sizeof(temp), "~%s", cwd + strlen(home));
+        strcpy(cwd, temp);
+    }
+
+    fprintf(ctx->out, COLOR_GREEN "%s" COLOR_RESET ":" COLOR_BLUE "%s" COLOR_RESET "$ ",
+           user ? user : "user", cwd);
+    fflush(ctx->out);
+}
+
+void add_to_history(const char *cmd)
+{
+    if (cmd == NULL || strlen(cmd) == 0)
+    {
+        return;
+    }
+
+    if (ctx->history_count < HISTORY_SIZE)
+    {
+        ctx->history[ctx->history_count] = strdup(cmd);
+        if (ctx->history[ctx->history_count] != NULL)
+        {
+            ctx->history_count++;
+        }
+    }
+    else
+    {
+        free(ctx->history[0]);
+        for (int i = 0; i < HISTORY_SIZE - 1; i++)
+        {
+            ctx->history[i] = ctx->history[i + 1];
+        }
+        ctx->history[HISTORY_SIZE - 1] = strdup(cmd);
+    }
+}
+
+void load_history(void)
+{
+    const char *home = get_var("HOME");
+    if (home == NULL)
+    {
+        return;
+    }
+
+    char path[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "%s/.myshell_history", home);
+
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+    {
+        return;
+    }
+
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), f) != NULL && ctx->history_count < HISTORY_SIZE)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (strlen(line) > 0)
+        {
+            ctx->history[ctx->history_count] = strdup(line);
+            if (ctx->history[ctx->history_count] != NULL)
+            {
+                ctx->history_count++;
+            }
+        }
+    }
+
+    fclose(f);
+}
+
+void save_history(void)
+{
+    const char *home = get_var("HOME");
+    if (home == NULL)
+    {
+        return;
+    }
+
+    char path[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "%s/.myshell_history", home);
+
+    FILE *f = fopen(path, "we");
+    if (f == NULL)
+    {
+        shell_perror("save_history");
+        return;
+    }
+
+    for (int i = 0; i < ctx->history_count; i++)
+    {
+        fprintf(f, "%s\n", ctx->history[i]);
+    }
+
+    fclose(f);
+}
+
+void free_history(void)
+{
+    for (int i = 0; i < ctx->history_count; i++)
+    {
+        free(ctx->history[i]);
+        ctx->history[i] = NULL;
+    }
+    ctx->history_count = 0;
+}
+
+// Expands !!, !n, !-n, !prefix and a leading ^old^new against the history.
+// Returns a malloc'd line, or NULL after reporting an unknown event.
+char *expand_history(const char *line)
+{
+    StrBuf out = {NULL, 0, 0};
+    int in_single_quote = 0;
+    int in_double_quote = 0;
+
+    sb_append(&out, "", 0);
+
+    if (line[0] == '^')
+    {
+        const char *old = line + 1;
+        const char *old_end = strchr(old, '^');
+        const char *prev = ctx->history_count > 0 ? ctx->history[ctx->history_count - 1] : NULL;
+        const char *hit = NULL;
+
+        if (old_end != NULL && old_end > old && prev != NULL)
+        {
+            for (hit = prev; *hit != '\0' && strncmp(hit, old, old_end - old) != 0; hit++)
+            {
+            }
+        }
+        if (hit == NULL || *hit == '\0')
+        {
+            fprintf(ctx->err, "%s: substitution failed\n", line);
+            free(out.data);
+            return NULL;
+        }
+
+        const char *new_text = old_end + 1;
+        size_t new_len = strcspn(new_text, "^");
+        sb_append(&out, prev, hit - prev);
+        sb_append(&out, new_text, new_len);
+        sb_append(&out, hit + (old_end - old), strlen(hit + (old_end - old)));
+        if (new_text[new_len] == '^')
+        {
+            sb_append(&out, new_text + new_len + 1, strlen(new_text + new_len + 1));
+        }
+        return out.data;
+    }
+
+    for (size_t i = 0; line[i] != '\0';)
+    {
+        char c = line[i];
+        char next = line[i + 1];
+
+        if (c == '\'' && !in_double_quote)
+        {
+            in_single_quote = !in_single_quote;
+        }
+        else if (c == '"' && !in_single_quote)
+        {
+            in_double_quote = !in_double_quote;
+        }
+
+        if (c == '\\' && next == '!')
+        {
+            sb_append(&out, line + i, 2);
+            i += 2;
+            continue;
+        }
+
+        if (c != '!' || in_single_quote || next == '\0' || strchr(" \t=(\"", next) != NULL ||
+            (i > 0 && line[i - 1] == '$'))
+        {
+            sb_putc(&out, c);
+            i++;
+            continue;
+        }
+
+        int index = -1;
+        size_t len;
+
+        if (next == '!')
+        {
+            index = ctx->history_count - 1;
+            len = 2;
+        }
+        else if (isdigit((unsigned char)next) || (next == '-' && isdigit((unsigned char)line[i + 2])))
+        {
+            char *end;
+            long n = strtol(line + i + 1, &end, 10);
+            index = n > 0 ? (int)(n - 1) : (int)(ctx->history_count + n);
+            len = end - (line + i);
+        }
+        else
+        {
+            // !prefix: most recent entry starting with the prefix
+            size_t prefix_len = strcspn(line + i + 1, " \t;|&<>'\"");
+            len = prefix_len + 1;
+            for (int h = ctx->history_count - 1; h >= 0; h--)
+            {
+                if (strncmp(ctx->history[h], line + i + 1, prefix_len) == 0)
+                {
+                    index = h;
+                    break;
+                }
+            }
+        }
+
+        if (index < 0 || index >= ctx->history_count)
+        {
+            fprintf(ctx->err, "%.*s: event not found\n", (int)len, line + i);
+            free(out.data);
+            return NULL;
+        }
+
+        sb_append(&out, ctx->history[index], strlen(ctx->history[index]));
+        i += len;
+    }
+
+    return out.data;
+}
+
+unsigned int hash_bytes(const char *s, size_t len)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the length of the arithmetic expression at s (just past "$((")
+// up to its closing "))", or -1 if the expression is unterminated.
+long arith_length(const char *s)
+{
+    int depth = 0;
+
+    for (long i = 0; s[i] != '\0'; i++)
+    {
+        if (s[i] == '(')
+        {
+            depth++;
+        }
+        else if (s[i] == ')')
+        {
+            if (depth == 0 && s[i + 1] == ')')
+            {
+                return i;
+            }
+            depth--;
+        }
+    }
+    return -1;
+}
+
+long long arith_apply(int op, long long a, long long b, int *error)
+{
+    // Unsigned math gives two's-complement wraparound instead of overflow UB
+    unsigned long long ua = (unsigned long long)a;
+    unsigned long long ub = (unsigned long long)b;
+
+    switch (op)
+    {
+    case ARITH_NEG:
+        return (long long)(0 - ua);
+    case ARITH_NOT:
+        return !a;
+    case ARITH_BITNOT:
+        return ~a;
+    case ARITH_MUL:
+        return (long long)(ua * ub);
+    case ARITH_DIV:
+    case ARITH_MOD:
+        if (b == 0)
+        {
+            *error = 1;
+            return 0;
+        }
+        if (a == LLONG_MIN && b == -1)
+        {
+            return op == ARITH_DIV ? a : 0;
+        }
+        return op == ARITH_DIV ? a / b : a % b;
+    case ARITH_ADD:
+        return (long long)(ua + ub);
+    case ARITH_SUB:
+        return (long long)(ua - ub);
+    case ARITH_SHL:
+        return (long long)(ua << (b & 63));
+    case ARITH_SHR:
+        return a >> (b & 63);
+    case ARITH_LT:
+        return a < b;
+    case ARITH_LE:
+        return a <= b;
+    case ARITH_GT:
+        return a > b;
+    case ARITH_GE:
+        return a >= b;
+    case ARITH_EQ:
+        return a == b;
+    case ARITH_NE:
+        return a != b;
+    case ARITH_BITAND:
+        return a & b;
+    case ARITH_XOR:
+        return a ^ b;
+    case ARITH_BITOR:
+        return a | b;
+    case ARITH_AND:
+        return a && b;
+    case ARITH_OR:
+        return a || b;
+    }
+    return 0;
+}
+
+// Builds a node, folding it to a literal when all operands are literals
+ArithNode *arith_node(ArithParser *ap, int op, ArithNode *left, ArithNode *right)
+{
+    int foldable = op != ARITH_VAR && op != ARITH_ASSIGN && op != ARITH_COMMA &&
+                   (op < ARITH_PREINC || op > ARITH_POSTDEC);
+
+    if (foldable && left != NULL && left->op == ARITH_NUM &&
+        (right == NULL || right->op == ARITH_NUM))
+    {
+        int error = 0;
+        long long value = arith_apply(op, left->value, right ? right->value : 0, &error);
+        if (!error)
+        {
+            left->value = value;
+            return left;
+        }
+    }
+
+    ArithNode *node = arena_alloc(ap->arena, sizeof(ArithNode));
+    memset(node, 0, sizeof(ArithNode));
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+void arith_skip_spaces(ArithParser *ap)
+{
+    while (ap->pos < ap->len && isspace((unsigned char)ap->s[ap->pos]))
+    {
+        ap->pos++;
+    }
+}
+
+// Consumes op if it is next in the input
+int arith_accept(ArithParser *ap, const char *op)
+{
+    size_t n = strlen(op);
+    arith_skip_spaces(ap);
+    if (ap->pos + n <= ap->len && strncmp(ap->s + ap->pos, op, n) == 0)
+    {
+        ap->pos += n;
+        return 1;
+    }
+    return 0;
+}
+
+size_t arith_name_length(ArithParser *ap)
+{
+    size_t n = 0;
+    const char *s = ap->s + ap->pos;
+
+    if (ap->pos < ap->len && (isalpha((unsigned char)s[0]) || s[0] == '_'))
+    {
+        while (ap->pos + n < ap->len && (isalnum((unsigned char)s[n]) || s[n] == '_'))
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+ArithNode *arith_parse_comma(ArithParser *ap);
+ArithNode *arith_parse_assign(ArithParser *ap);
+
+ArithNode *arith_parse_number(ArithParser *ap)
+{
+    unsigned long long value = 0;
+    int base = 10;
+    const char *s = ap->s;
+
+    if (s[ap->pos] == '0' && ap->pos + 1 < ap->len && (s[ap->pos + 1] == 'x' || s[ap->pos + 1] == 'X'))
+    {
+        base = 16;
+        ap->pos += 2;
+    }
+    else if (s[ap->pos] == '0')
+    {
+        base = 8;
+    }
+
+    while (ap->pos < ap->len && isalnum((unsigned char)s[ap->pos]))
+    {
+        char c = tolower((unsigned char)s[ap->pos]);
+        int digit = isdigit((unsigned char)c) ? c - '0' : c - 'a' + 10;
+        if (digit >= base)
+        {
+            ap->error = 1;
+            return NULL;
+        }
+        value = value * base + digit;
+        ap->pos++;
+    }
+
+    ArithNode *node = arith_node(ap, ARITH_NUM, NULL, NULL);
+    node->value = (long long)value;
+    return node;
+}
+
+// Reads a variable reference: NAME, $NAME, ${NAME} or a special parameter
+char *arith_parse_name(ArithParser *ap)
+{
+    const char *s = ap->s;
+    size_t start;
+    size_t n;
+
+    if (s[ap->pos] == '$')
+    {
+        ap->pos++;
+        if (ap->pos < ap->len && s[ap->pos] == '{')
+        {
+            const char *end = memchr(s + ap->pos, '}', ap->len - ap->pos);
+            if (end == NULL)
+            {
+                ap->error = 1;
+                return NULL;
+            }
+            start = ap->pos + 1;
+            ap->pos = end - s + 1;
+            return arena_strndup(ap->arena, s + start, end - (s + start));
+        }
+        if (ap->pos < ap->len && (isdigit((unsigned char)s[ap->pos]) || strchr("?#$", s[ap->pos]) != NULL))
+        {
+            return arena_strndup(ap->arena, s + ap->pos++, 1);
+        }
+    }
+
+    start = ap->pos;
+    n = arith_name_length(ap);
+    if (n == 0)
+    {
+        ap->error = 1;
+        return NULL;
+    }
+    ap->pos += n;
+    return arena_strndup(ap->arena, s + start, n);
+}
+
+ArithNode *arith_parse_primary(ArithParser *ap)
+{
+    arith_skip_spaces(ap);
+    if (ap->pos >= ap->len)
+    {
+        ap->error = 1;
+        return NULL;
+    }
+
+    const char *s = ap->s + ap->pos;
+
+    if (s[0] == '(' || (s[0] == '$' && ap->pos + 2 < ap->len && s[1] == '(' && s[2] == '('))
+    {
+        int nested = s[0] == '$';
+        ap->pos += nested ? 3 : 1;
+        ArithNode *node = arith_parse_comma(ap);
+        if (ap->error || !arith_accept(ap, nested ? "))" : ")"))
+        {
+            ap->error = 1;
+            return NULL;
+        }
+        return node;
+    }
+
+    if (isdigit((unsigned char)s[0]))
+    {
+        return arith_parse_number(ap);
+    }
+
+    char *name = arith_parse_name(ap);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+
+    ArithNode *node = arith_node(ap, ARITH_VAR, NULL, NULL);
+    node->name = name;
+
+    if (arith_accept(ap, "++") || arith_accept(ap, "--"))
+    {
+        node->op = ap->s[ap->pos - 1] == '+' ? ARITH_POSTINC : ARITH_POSTDEC;
+    }
+    return node;
+}
+
+ArithNode *arith_parse_unary(ArithParser *ap)
+{
+    if (arith_accept(ap, "++") || arith_accept(ap, "--"))
+    {
+        int op = ap->s[ap->pos - 1] == '+' ? ARITH_PREINC : ARITH_PREDEC;
+        arith_skip_spaces(ap);
+        char *name = arith_parse_name(ap);
+        if (name == NULL)
+        {
+            return NULL;
+        }
+        ArithNode *node = arith_node(ap, op, NULL, NULL);
+        node->name = name;
+        return node;
+    }
+
+    if (arith_accept(ap, "-"))
+    {
+        ArithNode *operand = arith_parse_unary(ap);
+        return ap->error ? NULL : arith_node(ap, ARITH_NEG, operand, NULL);
+    }
+    if (arith_accept(ap, "+"))
+    {
+        return arith_parse_unary(ap);
+    }
+    if (arith_accept(ap, "!"))
+    {
+        ArithNode *operand = arith_parse_unary(ap);
+        return ap->error ? NULL : arith_node(ap, ARITH_NOT, operand, NULL);
+    }
+    if (arith_accept(ap, "~"))
+    {
+        ArithNode *operand = arith_parse_unary(ap);
+        return ap->error ? NULL : arith_node(ap, ARITH_BITNOT, operand, NULL);
+    }
+    return arith_parse_primary(ap);
+}
+
+// Precedence climbing over the binary operators, loosest binding first
+ArithNode *arith_parse_binary(ArithParser *ap, int min_prec)
+{
+    static const struct
+    {
+        const char *text;
+        int op;
+        int prec;
+    } ops[] = {
+        {"||", ARITH_OR, 1}, {"&&", ARITH_AND, 2}, {"==", ARITH_EQ, 6}, {"!=", ARITH_NE, 6},
+        {"<<", ARITH_SHL, 8}, {">>", ARITH_SHR, 8}, {"<=", ARITH_LE, 7}, {">=", ARITH_GE, 7},
+        {"|", ARITH_BITOR, 3}, {"^", ARITH_XOR, 4}, {"&", ARITH_BITAND, 5}, {"<", ARITH_LT, 7},
+        {">", ARITH_GT, 7}, {"+", ARITH_ADD, 9}, {"-", ARITH_SUB, 9}, {"*", ARITH_MUL, 10},
+        {"/", ARITH_DIV, 10}, {"%", ARITH_MOD, 10}, {NULL, 0, 0}};
+
+    ArithNode *left = arith_parse_unary(ap);
+
+    while (!ap->error)
+    {
+        arith_skip_spaces(ap);
+
+        int i = 0;
+        const char *s = ap->s + ap->pos;
+        for (; ops[i].text != NULL; i++)
+        {
+            size_t n = strlen(ops[i].text);
+            if (ap->pos + n <= ap->len && strncmp(s, ops[i].text, n) == 0)
+            {
+                break;
+            }
+        }
+        if (ops[i].text == NULL || ops[i].prec < min_prec)
+        {
+            break;
+        }
+
+        ap->pos += strlen(ops[i].text);
+        ArithNode *right = arith_parse_binary(ap, ops[i].prec + 1);
+        if (ap->error)
+        {
+            return NULL;
+        }
+
+        // A literal left side decides && and || without the right side
+        if (left->op == ARITH_NUM && (ops[i].op == ARITH_AND || ops[i].op == ARITH_OR) &&
+            (left->value != 0) == (ops[i].op == ARITH_OR))
+        {
+            left->value = ops[i].op == ARITH_OR;
+            continue;
+        }
+        left = arith_node(ap, ops[i].op, left, right);
+    }
+    return ap->error ? NULL : left;
+}
+
+ArithNode *arith_parse_ternary(ArithParser *ap)
+{
+    ArithNode *cond = arith_parse_binary(ap, 1);
+    if (ap->error || !arith_accept(ap, "?"))
+    {
+        return cond;
+    }
+
+    ArithNode *then_node = arith_parse_comma(ap);
+    if (ap->error || !arith_accept(ap, ":"))
+    {
+        ap->error = 1;
+        return NULL;
+    }
+    ArithNode *else_node = arith_parse_assign(ap);
+    if (ap->error)
+    {
+        return NULL;
+    }
+
+    if (cond->op == ARITH_NUM)
+    {
+        return cond->value ? then_node : else_node;
+    }
+
+    ArithNode *node = arith_node(ap, ARITH_TERNARY, cond, then_node);
+    node->third = else_node;
+    return node;
+}
+
+ArithNode *arith_parse_assign(ArithParser *ap)
+{
+    static const struct
+    {
+        const char *text;
+        int op;
+    } ops[] = {
+        {"<<=", ARITH_SHL}, {">>=", ARITH_SHR}, {"*=", ARITH_MUL}, {"/=", ARITH_DIV},
+        {"%=", ARITH_MOD}, {"+=", ARITH_ADD}, {"-=", ARITH_SUB}, {"&=", ARITH_BITAND},
+        {"^=", ARITH_XOR}, {"|=", ARITH_BITOR}, {"=", 0}, {NULL, 0}};
+
+    size_t start = ap->pos;
+    arith_skip_spaces(ap);
+    size_t n = arith_name_length(ap);
+
+    if (n > 0)
+    {
+        char *name = arena_strndup(ap->arena, ap->s + ap->pos, n);
+        ap->pos += n;
+        arith_skip_spaces(ap);
+
+        for (int i = 0; ops[i].text != NULL; i++)
+        {
+            size_t len = strlen(ops[i].text);
+            const char *s = ap->s + ap->pos;
+            if (ap->pos + len <= ap->len && strncmp(s, ops[i].text, len) == 0 &&
+                !(ops[i].op == 0 && ap->pos + 1 < ap->len && s[1] == '='))
+            {
+                ap->pos += len;
+                ArithNode *value = arith_parse_assign(ap);
+                if (ap->error)
+                {
+                    return NULL;
+                }
+                ArithNode *node = arith_node(ap, ARITH_ASSIGN, NULL, value);
+                node->name = name;
+                node->value = ops[i].op;
+                return node;
+            }
+        }
+    }
+
+    ap->pos = start;
+    return arith_parse_ternary(ap);
+}
+
+ArithNode *arith_parse_comma(ArithParser *ap)
+{
+    ArithNode *left = arith_parse_assign(ap);
+    while (!ap->error && arith_accept(ap, ","))
+    {
+        ArithNode *right = arith_parse_assign(ap);
+        if (ap->error)
+        {
+            return NULL;
+        }
+        left = left->op == ARITH_NUM ? right : arith_node(ap, ARITH_COMMA, left, right);
+    }
+    return ap->error ? NULL : left;
+}
+
+ArithNode *arith_compile(const char *expr, size_t len, Arena *arena)
+{
+    ArithParser ap = {expr, 0, len, arena, 0};
+    ArithNode *root = arith_parse_comma(&ap);
+
+    arith_skip_spaces(&ap);
+    if (ap.error || ap.pos != ap.len)
+    {
+        return NULL;
+    }
+    return root;
+}
+
+// Returns the cached tree for expr, compiling it on a miss. Returns NULL
+// when the slot is pinned by an evaluation that is still running.
+ArithCacheEntry *arith_cache_lookup(const char *expr, size_t len)
+{
+    unsigned int hash = hash_bytes(expr, len);
+    ArithCacheEntry *entry = &ctx->arith_cache[hash % ARITH_CACHE_SIZE];
+
+    if (entry->expr != NULL && entry->hash == hash && entry->len == len &&
+        memcmp(entry->expr, expr, len) == 0)
+    {
+        return entry;
+    }
+    if (entry->busy > 0)
+    {
+        return NULL;
+    }
+
+    arena_free(&entry->arena);
+    entry->expr = arena_strndup(&entry->arena, expr, len);
+    entry->len = len;
+    entry->hash = hash;
+    entry->root = arith_compile(entry->expr, len, &entry->arena);
+    return entry;
+}
+
+long long arith_eval(ArithNode *node, int *error);
+
+long long arith_var(const char *name, int *error)
+{
+    char buf[32];
+    const char *value = lookup_param(name, buf, sizeof(buf));
+    long long result = 0;
+
+    if (value != NULL && *value != '\0' && arith_evaluate(value, strlen(value), &result) != 0)
+    {
+        *error = 1;
+    }
+    return result;
+}
+
+void arith_store(const char *name, long long value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", value);
+    set_var(name, buf, 0);
+}
+
+long long arith_eval(ArithNode *node, int *error)
+{
+    long long a;
+    long long b;
+    int div_error = 0;
+
+    if (*error)
+    {
+        return 0;
+    }
+
+    switch (node->op)
+    {
+    case ARITH_NUM:
+        return node->value;
+    case ARITH_VAR:
+        return arith_var(node->name, error);
+    case ARITH_PREINC:
+    case ARITH_PREDEC:
+    case ARITH_POSTINC:
+    case ARITH_POSTDEC:
+        a = arith_var(node->name, error);
+        b = arith_apply(node->op == ARITH_PREINC || node->op == ARITH_POSTINC ? ARITH_ADD : ARITH_SUB,
+                        a, 1, &div_error);
+        if (!*error)
+        {
+            arith_store(node->name, b);
+        }
+        return node->op == ARITH_PREINC || node->op == ARITH_PREDEC ? b : a;
+    case ARITH_ASSIGN:
+        b = arith_eval(node->right, error);
+        if (node->value != 0)
+        {
+            a = arith_var(node->name, error);
+            b = arith_apply((int)node->value, a, b, &div_error);
+        }
+        break;
+    case ARITH_AND:
+        return arith_eval(node->left, error) && arith_eval(node->right, error);
+    case ARITH_OR:
+        return arith_eval(node->left, error) || arith_eval(node->right, error);
+    case ARITH_TERNARY:
+        return arith_eval(node->left, error) ? arith_eval(node->right, error)
+                                             : arith_eval(node->third, error);
+    case ARITH_COMMA:
+        arith_eval(node->left, error);
+        return arith_eval(node->right, error);
+    default:
+        a = arith_eval(node->left, error);
+        b = node->right ? arith_eval(node->right, error) : 0;
+        b = arith_apply(node->op, a, b, &div_error);
+        break;
+    }
+
+    if (*error)
+    {
+        return 0;
+    }
+    if (div_error)
+    {
+        fprintf(ctx->err, "arithmetic: division by zero\n");
+        *error = 1;
+        return 0;
+    }
+    if (node->op == ARITH_ASSIGN)
+    {
+        arith_store(node->name, b);
+    }
+    return b;
+}
+
+// Evaluates an arithmetic expression; returns nonzero on error
+int arith_evaluate(const char *expr, size_t len, long long *result)
+{
+    Arena temp = {NULL};
+    ArithNode *root;
+    int error = 0;
+    size_t digits = 0;
+
+    *result = 0;
+
+    // Plain decimal values (the common case for variables) skip the parser
+    while (digits < len && isdigit((unsigned char)expr[digits]))
+    {
+        digits++;
+    }
+    if (digits > 0 && digits == len && (expr[0] != '0' || len == 1))
+    {
+        *result = strtoll(expr, NULL, 10);
+        return 0;
+    }
+
+    // An empty expression, as in $(( )), is 0
+    size_t blank = 0;
+    while (blank < len && isspace((unsigned char)expr[blank]))
+    {
+        blank++;
+    }
+    if (blank == len)
+    {
+        return 0;
+    }
+
+    if (ctx->arith_depth >= ARITH_MAX_DEPTH)
+    {
+        fprintf(ctx->err, "%.*s: expression recursion level exceeded\n", (int)len, expr);
+        return 1;
+    }
+
+    ArithCacheEntry *entry = arith_cache_lookup(expr, len);
+    root = entry ? entry->root : arith_compile(expr, len, &temp);
+
+    if (root == NULL)
+    {
+        fprintf(ctx->err, "%.*s: arithmetic syntax error\n", (int)len, expr);
+        arena_free(&temp);
+        return 1;
+    }
+
+    if (entry != NULL)
+    {
+        entry->busy++;
+    }
+    ctx->arith_depth++;
+    *result = arith_eval(root, &error);
+    ctx->arith_depth--;
+    if (entry != NULL)
+    {
+        entry->busy--;
+    }
+
+    arena_free(&temp);
+    return error != 0;
+}
+
+// Splits a line into operator and word tokens. Words keep their quotes and
+// are expanded at execution time, so loop bodies see fresh variable values.
+Token *parse_line(const char *line, Arena *arena, int *status)
+{
+    int capacity = 16;
+    int count = 0;
+    Token *tokens = arena_alloc(arena, capacity * sizeof(Token));
+    size_t i = 0;
+
+    *status = PARSE_OK;
+
+    while (1)
+    {
+        while (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')
+        {
+            i++;
+        }
+
+        if (line[i] == '#')
+        {
+            while (line[i] != '\0' && line[i] != '\n')
+            {
+                i++;
+            }
+        }
+
+        if (count + 1 >= capacity)
+        {
+            tokens = arena_grow(arena, tokens, capacity * sizeof(Token),
+                                capacity * 2 * sizeof(Token));
+            capacity *= 2;
+        }
+
+        Token *tok = &tokens[count];
+        tok->text = NULL;
+
+        if (line[i] == '\0')
+        {
+            tok->type = TOK_EOF;
+            break;
+        }
+
+        count++;
+
+        if (line[i] == '\n')
+        {
+            tok->type = TOK_NEWLINE;
+            i++;
+            continue;
+        }
+
+        if (line[i] == ';')
+        {
+            tok->type = TOK_SEMI;
+            i++;
+            continue;
+        }
+
+        if (line[i] == '|')
+        {
+            tok->type = line[i + 1] == '|' ? TOK_OR : TOK_PIPE;
+            i += tok->type == TOK_OR ? 2 : 1;
+            continue;
+        }
+
+        if (line[i] == '&' && line[i + 1] == '&')
+        {
+            tok->type = TOK_AND;
+            i += 2;
+            continue;
+        }
+
+        if (line[i] == '(' || line[i] == ')')
+        {
+            tok->type = line[i] == '(' ? TOK_LPAREN : TOK_RPAREN;
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        int in_single_quote = 0;
+        int in_double_quote = 0;
+
+        while (line[i] != '\0')
+        {
+            char c = line[i];
+
+            if (in_single_quote)
+            {
+                in_single_quote = c != '\'';
+                i++;
+                continue;
+            }
+
+            if (c == '\\')
+            {
+                if (line[i + 1] == '\0')
+                {
+                    *status = PARSE_INCOMPLETE;
+                    return NULL;
+                }
+                i += 2;
+                continue;
+            }
+
+            // $(( )) may contain blanks and operators; compile it while here
+            if (c == '$' && line[i + 1] == '(' && line[i + 2] == '(')
+            {
+                long len = arith_length(line + i + 3);
+                if (len < 0)
+                {
+                    *status = PARSE_INCOMPLETE;
+                    return NULL;
+                }
+                arith_cache_lookup(line + i + 3, len);
+                i += len + 5;
+                continue;
+            }
+
+            if (c == '"')
+            {
+                in_double_quote = !in_double_quote;
+                i++;
+                continue;
+            }
+
+            if (!in_double_quote)
+            {
+                if (c == '\'')
+                {
+                    in_single_quote = 1;
+                }
+                else if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' ||
+                         c == '|' || c == '(' || c == ')' || (c == '&' && line[i + 1] == '&'))
+                {
+                    break;
+                }
+            }
+            i++;
+        }
+
+        if (in_single_quote || in_double_quote)
+        {
+            *status = PARSE_INCOMPLETE;
+            return NULL;
+        }
+
+        tok->type = TOK_WORD;
+        tok->text = arena_strndup(arena, line + start, i - start);
+    }
+
+    return tokens;
+}
+
+// Decodes a redirection word: [n]< [n]> [n]>> with a file, [n]<& [n]>&
+// with an fd to copy or - to close. The target may be attached or be the
+// next word. Returns the target's offset in word (its length when the
+// target is the next word), or -1 if word is not a redirection.
+int redirection_op(const char *word, Redirect *r)
+{
+    int i = 0;
+    int fd = -1;
+    int type;
+
+    if (isdigit((unsigned char)word[0]))
+    {
+        fd = word[0] - '0';
+        i++;
+    }
+    if (word[i] == '<')
+    {
+        type = REDIR_IN;
+        fd = fd < 0 ? 0 : fd;
+    }
+    else if (word[i] == '>')
+    {
+        type = word[i + 1] == '>' ? REDIR_APPEND : REDIR_OUT;
+        fd = fd < 0 ? 1 : fd;
+        i += type == REDIR_APPEND;
+    }
+    else
+    {
+        return -1;
+    }
+    i++;
+    if (word[i] == '&' && type != REDIR_APPEND)
+    {
+        type = strcmp(word + i + 1, "-") == 0 ? REDIR_CLOSE : REDIR_DUP;
+        i++;
+    }
+    // <<, <> and the like are not supported
+    if (word[i] == '<' || word[i] == '>' || word[i] == '&')
+    {
+        return -1;
+    }
+
+    if (r != NULL)
+    {
+        r->fd = fd;
+        r->type = type;
+        r->target = NULL;
+    }
+    return i;
+}
+
+int is_redirection(const char *word)
+{
+    return redirection_op(word, NULL) >= 0;
+}
+
+// Whether word is a redirection whose target is the next word
+int redirection_wants_target(const char *word)
+{
+    Redirect r;
+    int offset = redirection_op(word, &r);
+    return offset >= 0 && r.type != REDIR_CLOSE && word[offset] == '\0';
+}
+
+// Moves redirections and their targets out of cmd->args, keeping them in
+// order. Returns -1 if an operator is missing its target.
+int parse_redirections(Command *cmd, Arena *arena)
+{
+    int count = 0;
+    for (int i = 0; cmd->args[i] != NULL; i++)
+    {
+        count += is_redirection(cmd->args[i]);
+    }
+
+    cmd->redirs = count > 0 ? arena_alloc(arena, count * sizeof(Redirect)) : NULL;
+    cmd->num_redirs = 0;
+
+    int out = 0;
+    for (int i = 0; cmd->args[i] != NULL; i++)
+    {
+        char *word = cmd->args[i];
+        Redirect *r = &cmd->redirs[cmd->num_redirs];
+        int offset = count > 0 ? redirection_op(word, r) : -1;
+
+        if (offset < 0)
+        {
+            cmd->args[out++] = word;
+            continue;
+        }
+        cmd->num_redirs++;
+        if (r->type == REDIR_CLOSE)
+        {
+            continue;
+        }
+
+        if (word[offset] != '\0')
+        {
+            r->target = word + offset;
+        }
+        else if (cmd->args[i + 1] != NULL)
+        {
+            r->target = cmd->args[++i];
+        }
+        else
+        {
+            cmd->args[out] = NULL;
+            return -1;
+        }
+    }
+    cmd->args[out] = NULL;
+    return 0;
+}
+
+Token *peek_token(Parser *p)
+{
+    return &p->tokens[p->pos];
+}
+
+void next_token(Parser *p)
+{
+    if (p->tokens[p->pos].type != TOK_EOF)
+    {
+        p->pos++;
+    }
+}
+
+int is_reserved_word(Token *tok, const char *word)
+{
+    return tok->type == TOK_WORD && strcmp(tok->text, word) == 0;
+}
+
+int at_list_terminator(Parser *p)
+{
+    static const char *terminators[] = {"then", "elif", "else", "fi", "do", "done", "}", NULL};
+    Token *tok = peek_token(p);
+
+    if (tok->type == TOK_EOF || tok->type == TOK_RPAREN)
+    {
+        return 1;
+    }
+    for (int i = 0; terminators[i] != NULL; i++)
+    {
+        if (is_reserved_word(tok, terminators[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void skip_newlines(Parser *p)
+{
+    while (peek_token(p)->type == TOK_NEWLINE)
+    {
+        next_token(p);
+    }
+}
+
+// Running out of tokens mid-construct means the caller should read more lines
+void syntax_error(Parser *p)
+{
+    static const char *names[] = {NULL, "newline", ";", "|", "&&", "||", NULL, "(", ")"};
+    Token *tok = peek_token(p);
+
+    if (p->status != PARSE_OK)
+    {
+        return;
+    }
+    if (tok->type == TOK_EOF)
+    {
+        p->status = PARSE_INCOMPLETE;
+        return;
+    }
+
+    p->status = PARSE_ERROR;
+    if (!ctx->prefetching)
+    {
+        fprintf(ctx->err, "syntax error near unexpected token `%s'\n",
+                tok->type == TOK_WORD ? tok->text : names[tok->type]);
+    }
+}
+
+int expect_word(Parser *p, const char *word)
+{
+    if (!is_reserved_word(peek_token(p), word))
+    {
+        syntax_error(p);
+        return 0;
+    }
+    next_token(p);
+    return 1;
+}
+
+CommandList *parse_list(Parser *p);
+
+CommandList *parse_body(Parser *p)
+{
+    CommandList *list = parse_list(p);
+    if (p->status == PARSE_OK && list->num_groups == 0)
+    {
+        syntax_error(p);
+    }
+    return p->status == PARSE_OK ? list : NULL;
+}
+
+CommandList *wrap_compound(Parser *p, Compound *compound)
+{
+    CommandList *list = arena_alloc(p->arena, sizeof(CommandList));
+    list->groups = arena_alloc(p->arena, sizeof(CommandGroup));
+    list->num_groups = 1;
+    list->groups[0].commands = arena_alloc(p->arena, sizeof(Command));
+    list->groups[0].num_commands = 1;
+    list->groups[0].operator = OP_NONE;
+    list->groups[0].negate = 0;
+    memset(list->groups[0].commands, 0, sizeof(Command));
+    list->groups[0].commands[0].args = arena_alloc(p->arena, sizeof(char *));
+    list->groups[0].commands[0].args[0] = NULL;
+    list->groups[0].commands[0].compound = compound;
+    return list;
+}
+
+// Called with "if" or "elif" as the current token
+Compound *parse_if(Parser *p)
+{
+    Compound *c = arena_alloc(p->arena, sizeof(Compound));
+    memset(c, 0, sizeof(Compound));
+    c->type = COMPOUND_IF;
+
+    next_token(p);
+    if ((c->cond = parse_body(p)) == NULL || !expect_word(p, "then") ||
+        (c->body = parse_body(p)) == NULL)
+    {
+        return NULL;
+    }
+
+    if (is_reserved_word(peek_token(p), "elif"))
+    {
+        Compound *nested = parse_if(p);
+        if (nested == NULL)
+        {
+            return NULL;
+        }
+        c->else_body = wrap_compound(p, nested);
+        return c;
+    }
+
+    if (is_reserved_word(peek_token(p), "else"))
+    {
+        next_token(p);
+        if ((c->else_body = parse_body(p)) == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    return expect_word(p, "fi") ? c : NULL;
+}
+
+Compound *parse_for(Parser *p)
+{
+    Compound *c = arena_alloc(p->arena, sizeof(Compound));
+    memset(c, 0, sizeof(Compound));
+    c->type = COMPOUND_FOR;
+
+    next_token(p);
+    Token *tok = peek_token(p);
+    if (tok->type != TOK_WORD || !is_valid_name(tok->text, strlen(tok->text)))
+    {
+        syntax_error(p);
+        return NULL;
+    }
+    c->var = tok->text;
+    next_token(p);
+    skip_newlines(p);
+
+    if (is_reserved_word(peek_token(p), "in"))
+    {
+        int count = 0;
+        int capacity = 8;
+        c->words = arena_alloc(p->arena, capacity * sizeof(char *));
+
+        next_token(p);
+        while (peek_token(p)->type == TOK_WORD)
+        {
+            if (count + 1 >= capacity)
+            {
+                c->words = arena_grow(p->arena, c->words, capacity * sizeof(char *),
+                                      capacity * 2 * sizeof(char *));
+                capacity *= 2;
+            }
+            c->words[count++] = peek_token(p)->text;
+            next_token(p);
+        }
+        c->words[count] = NULL;
+
+        tok = peek_token(p);
+        if (tok->type != TOK_SEMI && tok->type != TOK_NEWLINE)
+        {
+            syntax_error(p);
+            return NULL;
+        }
+        next_token(p);
+    }
+    else if (peek_token(p)->type == TOK_SEMI)
+    {
+        next_token(p);
+    }
+
+    skip_newlines(p);
+    if (!expect_word(p, "do") || (c->body = parse_body(p)) == NULL ||
+        !expect_word(p, "done"))
+    {
+        return NULL;
+    }
+    return c;
+}
+
+Compound *parse_while(Parser *p, int type)
+{
+    Compound *c = arena_alloc(p->arena, sizeof(Compound));
+    memset(c, 0, sizeof(Compound));
+    c->type = type;
+
+    next_token(p);
+    if ((c->cond = parse_body(p)) == NULL || !expect_word(p, "do") ||
+        (c->body = parse_body(p)) == NULL || !expect_word(p, "done"))
+    {
+        return NULL;
+    }
+    return c;
+}
+
+int word_changes_state(const char *word)
+{
+    const char *arith = strstr(word, "$((");
+    return arith != NULL && (strchr(arith, '=') != NULL || strstr(arith, "++") != NULL ||
+                             strstr(arith, "--") != NULL);
+}
+
+int redirs_change_state(Command *cmd)
+{
+    for (int i = 0; i < cmd->num_redirs; i++)
+    {
+        if (cmd->redirs[i].target != NULL && word_changes_state(cmd->redirs[i].target))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Builtins that act on the shell itself rather than on their output
+int builtin_changes_state(const char *name)
+{
+    static const char *builtins[] = {"cd", "exit", "export", "unset", "set", "shift",
+                                     "read", "break", "continue", "memo", "limit", "exec", NULL};
+    for (int i = 0; builtins[i] != NULL; i++)
+    {
+        if (strcmp(name, builtins[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int list_changes_state(CommandList *list);
+
+// Conservatively decides whether running cmd could leave a trace in the
+// shell: assignments, state-changing builtins, loop variables, names
+// only known after expansion.
+int command_changes_state(Command *cmd)
+{
+    Compound *c = cmd->compound;
+
+    if (redirs_change_state(cmd))
+    {
+        return 1;
+    }
+    if (c != NULL)
+    {
+        if (c->type == COMPOUND_FOR)
+        {
+            return 1;
+        }
+        return (c->cond != NULL && list_changes_state(c->cond)) ||
+               (c->body != NULL && list_changes_state(c->body)) ||
+               (c->else_body != NULL && list_changes_state(c->else_body));
+    }
+
+    if (cmd->args[0] == NULL || strpbrk(cmd->args[0], "$`'\"\\") != NULL ||
+        is_assignment(cmd->args[0]))
+    {
+        return cmd->args[0] != NULL;
+    }
+    if (builtin_changes_state(cmd->args[0]))
+    {
+        return 1;
+    }
+    for (int i = 1; cmd->args[i] != NULL; i++)
+    {
+        if (word_changes_state(cmd->args[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int list_changes_state(CommandList *list)
+{
+    for (int g = 0; g < list->num_groups; g++)
+    {
+        for (int i = 0; i < list->groups[g].num_commands; i++)
+        {
+            if (command_changes_state(&list->groups[g].commands[i]))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Called with "{" or "(" as the current token
+Compound *parse_group(Parser *p, int type)
+{
+    Compound *c = arena_alloc(p->arena, sizeof(Compound));
+    memset(c, 0, sizeof(Compound));
+    c->type = type;
+
+    next_token(p);
+    if ((c->body = parse_body(p)) == NULL)
+    {
+        return NULL;
+    }
+
+    if (type == COMPOUND_BRACE)
+    {
+        return expect_word(p, "}") ? c : NULL;
+    }
+    if (peek_token(p)->type != TOK_RPAREN)
+    {
+        syntax_error(p);
+        return NULL;
+    }
+    next_token(p);
+
+    // A subshell that leaves the shell untouched can skip its fork
+    c->needs_fork = list_changes_state(c->body);
+    return c;
+}
+
+int parse_command(Parser *p, Command *cmd)
+{
+    Token *tok = peek_token(p);
+    int count = 0;
+    int capacity = 8;
+
+    memset(cmd, 0, sizeof(Command));
+
+    if ((tok->type != TOK_WORD && tok->type != TOK_LPAREN) || at_list_terminator(p))
+    {
+        syntax_error(p);
+        return 0;
+    }
+
+    if (tok->type == TOK_LPAREN)
+    {
+        cmd->compound = parse_group(p, COMPOUND_SUBSHELL);
+    }
+    else if (is_reserved_word(tok, "{"))
+    {
+        cmd->compound = parse_group(p, COMPOUND_BRACE);
+    }
+    else if (is_reserved_word(tok, "if"))
+    {
+        cmd->compound = parse_if(p);
+    }
+    else if (is_reserved_word(tok, "for"))
+    {
+        cmd->compound = parse_for(p);
+    }
+    else if (is_reserved_word(tok, "while"))
+    {
+        cmd->compound = parse_while(p, COMPOUND_WHILE);
+    }
+    else if (is_reserved_word(tok, "until"))
+    {
+        cmd->compound = parse_while(p, COMPOUND_UNTIL);
+    }
+
+    if (p->status != PARSE_OK)
+    {
+        return 0;
+    }
+
+    // Compound commands only accept trailing redirections
+    cmd->args = arena_alloc(p->arena, capacity * sizeof(char *));
+    while ((tok = peek_token(p))->type == TOK_WORD)
+    {
+        if (cmd->compound != NULL && !is_redirection(tok->text) &&
+            (count == 0 || !redirection_wants_target(cmd->args[count - 1])))
+        {
+            syntax_error(p);
+            return 0;
+        }
+        if (count + 1 >= capacity)
+        {
+            cmd->args = arena_grow(p->arena, cmd->args, capacity * sizeof(char *),
+                                   capacity * 2 * sizeof(char *));
+            capacity *= 2;
+        }
+        cmd->args[count++] = tok->text;
+        next_token(p);
+    }
+    cmd->args[count] = NULL;
+
+    if (parse_redirections(cmd, p->arena) != 0)
+    {
+        p->status = PARSE_ERROR;
+        if (!ctx->prefetching)
+        {
+            fprintf(ctx->err, "syntax error near unexpected token `%s'\n",
+                    tok->type == TOK_WORD ? tok->text : "newline");
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int parse_pipeline(Parser *p, CommandGroup *group)
+{
+    Command commands[MAX_COMMANDS];
+    int num_commands = 0;
+
+    group->negate = 0;
+    if (is_reserved_word(peek_token(p), "!"))
+    {
+        group->negate = 1;
+        next_token(p);
+    }
+
+    while (1)
+    {
+        if (num_commands == MAX_COMMANDS)
+        {
+            if (!ctx->prefetching)
+            {
+                fprintf(ctx->err, "syntax error: too many commands in pipeline\n");
+            }
+            p->status = PARSE_ERROR;
+            return 0;
+        }
+        if (!parse_command(p, &commands[num_commands]))
+        {
+            return 0;
+        }
+        num_commands++;
+
+        if (peek_token(p)->type != TOK_PIPE)
+        {
+            break;
+        }
+        next_token(p);
+        skip_newlines(p);
+    }
+
+    group->commands = arena_alloc(p->arena, num_commands * sizeof(Command));
+    memcpy(group->commands, commands, num_commands * sizeof(Command));
+    group->num_commands = num_commands;
+    return 1;
+}
+
+// list := and_or ((';' | '\n') and_or)*, stopping at a reserved terminator
+CommandList *parse_list(Parser *p)
+{
+    CommandList *list = arena_alloc(p->arena, sizeof(CommandList));
+    int capacity = 0;
+
+    list->groups = NULL;
+    list->num_groups = 0;
+
+    while (p->status == PARSE_OK)
+    {
+        while (peek_token(p)->type == TOK_NEWLINE || peek_token(p)->type == TOK_SEMI)
+        {
+            next_token(p);
+        }
+        if (at_list_terminator(p))
+        {
+            break;
+        }
+
+        int operator = OP_NONE;
+        while (1)
+        {
+            if (list->num_groups == capacity)
+            {
+                int new_capacity = capacity ? capacity * 2 : 4;
+                list->groups = arena_grow(p->arena, list->groups,
+                                          capacity * sizeof(CommandGroup),
+                                          new_capacity * sizeof(CommandGroup));
+                capacity = new_capacity;
+            }
+
+            CommandGroup *group = &list->groups[list->num_groups];
+            if (!parse_pipeline(p, group))
+            {
+                return list;
+            }
+            group->operator = operator;
+            list->num_groups++;
+
+            Token *tok = peek_token(p);
+            if (tok->type == TOK_LPAREN)
+            {
+                syntax_error(p);
+                return list;
+            }
+            if (tok->type != TOK_AND && tok->type != TOK_OR)
+            {
+                break;
+            }
+            operator = tok->type == TOK_AND ? OP_AND : OP_OR;
+            next_token(p);
+            skip_newlines(p);
+        }
+    }
+
+    return list;
+}
+
+int parse_program(const char *text, Arena *arena, CommandList **out)
+{
+    int status;
+    Token *tokens = parse_line(text, arena, &status);
+    if (status != PARSE_OK)
+    {
+        return status;
+    }
+
+    Parser p = {tokens, 0, arena, PARSE_OK};
+    *out = parse_list(&p);
+    if (p.status == PARSE_OK && peek_token(&p)->type != TOK_EOF)
+    {
+        syntax_error(&p);
+    }
+    return p.status;
+}
+
+// Parses one parameter reference at s ("$name", "${name}", "$?", ...) into
+// name and returns the number of characters consumed, or 0 for a literal '$'.
+size_t parse_param(const char *s, char *name, size_t name_size)
+{
+    size_t len = 0;
+    size_t consumed;
+
+    if (s[1] == '{')
+    {
+        const char *end = strchr(s + 2, '}');
+        if (end == NULL)
+        {
+            return 0;
+        }
+        len = end - (s + 2);
+        if (len >= name_size)
+        {
+            len = name_size - 1;
+        }
+        memcpy(name, s + 2, len);
+        name[len] = '\0';
+        return end - s + 1;
+    }
+
+    if (s[1] != '\0' && (strchr("?$#@*", s[1]) != NULL || isdigit((unsigned char)s[1])))
+    {
+        len = 1;
+    }
+    else
+    {
+        while (isalnum((unsigned char)s[1 + len]) || s[1 + len] == '_')
+        {
+            len++;
+        }
+        if (len == 0)
+        {
+            return 0;
+        }
+    }
+
+    consumed = len + 1;
+    if (len >= name_size)
+    {
+        len = name_size - 1;
+    }
+    memcpy(name, s + 1, len);
+    name[len] = '\0';
+    return consumed;
+}
+
+const char *lookup_param(const char *name, char *buf, size_t buf_size)
+{
+    if (strcmp(name, "?") == 0)
+    {
+        snprintf(buf, buf_size, "%d", ctx->shell_status);
+        return buf;
+    }
+    if (strcmp(name, "$") == 0)
+    {
+        snprintf(buf, buf_size, "%d", (int)ctx->pid);
+        return buf;
+    }
+    if (strcmp(name, "#") == 0)
+    {
+        snprintf(buf, buf_size, "%d", ctx->positional_count);
+        return buf;
+    }
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0)
+    {
+        StrBuf joined = {NULL, 0, 0};
+        sb_append(&joined, "", 0);
+        for (int i = 0; i < ctx->positional_count; i++)
+        {
+            if (i > 0)
+            {
+                sb_putc(&joined, ' ');
+            }
+            sb_append(&joined, ctx->positional[i], strlen(ctx->positional[i]));
+        }
+        char *value = arena_strndup(&ctx->scratch, joined.data, joined.len);
+        free(joined.data);
+        return value;
+    }
+    if (isdigit((unsigned char)name[0]))
+    {
+        int n = atoi(name);
+        if (n == 0)
+        {
+            return ctx->script_name;
+        }
+        return n <= ctx->positional_count ? ctx->positional[n - 1] : NULL;
+    }
+    return get_var(name);
+}
+
+// Performs parameter expansion, field splitting (when split is set) and
+// quote removal on a raw word, appending the resulting fields to out.
+void expand_word(const char *raw, WordList *out, int split)
+{
+    if (strpbrk(raw, "'\"\\$") == NULL)
+    {
+        wordlist_push(out, (char *)raw);
+        return;
+    }
+
+    // "$@" keeps each positional parameter as its own field
+    if (strcmp(raw, "\"$@\"") == 0)
+    {
+        for (int i = 0; i < ctx->positional_count; i++)
+        {
+            wordlist_push(out, arena_strndup(&ctx->scratch, ctx->positional[i], strlen(ctx->positional[i])));
+        }
+        return;
+    }
+
+    const char *ifs = NULL;
+    if (split)
+    {
+        ifs = get_var("IFS");
+        if (ifs == NULL)
+        {
+            ifs = " \t\n";
+        }
+    }
+
+    StrBuf field = {NULL, 0, 0};
+    int has_field = 0;
+    int in_double_quote = 0;
+    size_t i = 0;
+
+    sb_append(&field, "", 0);
+
+    while (raw[i] != '\0')
+    {
+        char c = raw[i];
+
+        if (c == '\'' && !in_double_quote)
+        {
+            size_t end = i + 1;
+            while (raw[end] != '\0' && raw[end] != '\'')
+            {
+                end++;
+            }
+            sb_append(&field, raw + i + 1, end - i - 1);
+            has_field = 1;
+            i = raw[end] != '\0' ? end + 1 : end;
+            continue;
+        }
+
+        if (c == '"')
+        {
+            in_double_quote = !in_double_quote;
+            has_field = 1;
+            i++;
+            continue;
+        }
+
+        if (c == '\\')
+        {
+            char next = raw[i + 1];
+            if (next == '\n')
+            {
+                i += 2;
+                continue;
+            }
+            if (next != '\0' && (!in_double_quote || strchr("$`\"\\", next) != NULL))
+            {
+                sb_putc(&field, next);
+                has_field = 1;
+                i += 2;
+                continue;
+            }
+        }
+
+        if (c == '$')
+        {
+            char name[256];
+            char buf[32];
+            const char *value = NULL;
+            size_t consumed = 0;
+            long len;
+
+            if (raw[i + 1] == '(' && raw[i + 2] == '(' && (len = arith_length(raw + i + 3)) >= 0)
+            {
+                long long result;
+                if (arith_evaluate(raw + i + 3, len, &result) != 0)
+                {
+                    ctx->expansion_failed = 1;
+                }
+                snprintf(buf, sizeof(buf), "%lld", result);
+                value = buf;
+                consumed = len + 5;
+            }
+            else if ((consumed = parse_param(raw + i, name, sizeof(name))) > 0)
+            {
+                value = lookup_param(name, buf, sizeof(buf));
+            }
+
+            if (consumed > 0)
+            {
+                i += consumed;
+                if (value == NULL)
+                {
+                    continue;
+                }
+
+                if (in_double_quote || ifs == NULL || *ifs == '\0')
+                {
+                    sb_append(&field, value, strlen(value));
+                    has_field = has_field || *value != '\0' || !split;
+                    continue;
+                }
+
+                for (const char *v = value; *v != '\0'; v++)
+                {
+                    if (strchr(ifs, *v) == NULL)
+                    {
+                        sb_putc(&field, *v);
+                        has_field = 1;
+                    }
+                    else if (has_field)
+                    {
+                        wordlist_push(out, arena_strndup(&ctx->scratch, field.data, field.len));
+                        field.len = 0;
+                        has_field = 0;
+                    }
+                }
+                continue;
+            }
+        }
+
+        sb_putc(&field, c);
+        has_field = 1;
+        i++;
+    }
+
+    if (has_field)
+    {
+        wordlist_push(out, arena_strndup(&ctx->scratch, field.data, field.len));
+    }
+    free(field.data);
+}
+
+// Expands a word that must stay a single field (redirection targets, assignments)
+char *expand_single(const char *raw)
+{
+    WordList fields = {NULL, 0, 0};
+    expand_word(raw, &fields, 0);
+    return fields.count > 0 ? fields.items[0] : "";
+}
+
+// Fills out with cmd's expanded arguments and redirection targets; leading
+// NAME=value words are collected raw into assigns. Returns nonzero if an
+// expansion failed.
+int expand_command(Command *cmd, Command *out, WordList *assigns)
+{
+    WordList args = {NULL, 0, 0};
+    int i = 0;
+
+    *out = *cmd;
+    ctx->expansion_failed = 0;
+
+    while (cmd->args[i] != NULL && is_assignment(cmd->args[i]))
+    {
+        wordlist_push(assigns, cmd->args[i]);
+        i++;
+    }
+
+    for (; cmd->args[i] != NULL; i++)
+    {
+        expand_word(cmd->args[i], &args, 1);
+    }
+
+    if (args.items == NULL)
+    {
+        args.items = arena_alloc(&ctx->scratch, sizeof(char *));
+        args.items[0] = NULL;
+    }
+
+    out->args = args.items;
+    if (cmd->num_redirs > 0)
+    {
+        out->redirs = arena_alloc(&ctx->scratch, cmd->num_redirs * sizeof(Redirect));
+        for (int r = 0; r < cmd->num_redirs; r++)
+        {
+            out->redirs[r] = cmd->redirs[r];
+            if (cmd->redirs[r].target != NULL)
+            {
+                out->redirs[r].target = expand_single(cmd->redirs[r].target);
+            }
+        }
+    }
+    return ctx->expansion_failed;
+}
+
+int apply_assignment(const char *raw, int exported)
+{
+    const char *eq = strchr(raw, '=');
+    char *name = arena_strndup(&ctx->scratch, raw, eq - raw);
+
+    ctx->expansion_failed = 0;
+    char *value = expand_single(eq + 1);
+    if (ctx->expansion_failed)
+    {
+        return 1;
+    }
+    set_var(name, value, exported);
+    return 0;
+}
+
+int is_builtin(char *cmd)
 {
     return (strcmp(cmd, "exit") == 0 ||
             strcmp(cmd, "echo") == 0 ||
@@ -337,590 +3293,3863 @@ int is_builtin(char *cmd)
             strcmp(cmd, "type") == 0 ||
             strcmp(cmd, "history") == 0 ||
             strcmp(cmd, "help") == 0 ||
-            strcmp(cmd, "clear") == 0);
+            strcmp(cmd, "clear") == 0 ||
+            strcmp(cmd, "true") == 0 ||
+            strcmp(cmd, "false") == 0 ||
+            strcmp(cmd, "test") == 0 ||
+            strcmp(cmd, "[") == 0 ||
+            strcmp(cmd, "printf") == 0 ||
+            strcmp(cmd, "read") == 0 ||
+            strcmp(cmd, "break") == 0 ||
+            strcmp(cmd, "continue") == 0 ||
+            strcmp(cmd, "export") == 0 ||
+            strcmp(cmd, "set") == 0 ||
+            strcmp(cmd, "shift") == 0 ||
+            strcmp(cmd, "unset") == 0 ||
+            strcmp(cmd, "memo") == 0 ||
+            strcmp(cmd, "limit") == 0 ||
+            strcmp(cmd, "cgstat") == 0 ||
+            strcmp(cmd, "exec") == 0);
+}
+
+int builtin_help(void)
+{
+    fprintf(ctx->out, "\n" COLOR_CYAN "MyShell v%s - Built-in Commands\n" COLOR_RESET "\n", SHELL_VERSION);
+
+    fprintf(ctx->out, COLOR_YELLOW "Navigation & Files:\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "cd [dir]" COLOR_RESET "      Change directory (no arg = HOME)\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "pwd" COLOR_RESET "           Print working directory\n");
+    fprintf(ctx->out, "\n");
+
+    fprintf(ctx->out, COLOR_YELLOW "Information:\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "type <cmd>" COLOR_RESET "   Show command type and location\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "history" COLOR_RESET "      Show command history\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "help" COLOR_RESET "         Show this help message\n");
+    fprintf(ctx->out, "\n");
+
+    fprintf(ctx->out, COLOR_YELLOW "Output:\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "echo [text]" COLOR_RESET "  Print text to stdout\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "printf fmt" COLOR_RESET "   Print formatted text\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "clear" COLOR_RESET "        Clear the screen\n");
+    fprintf(ctx->out, "\n");
+
+    fprintf(ctx->out, COLOR_YELLOW "Scripting:\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "test, [ ]" COLOR_RESET "    Evaluate a condition\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "read [-r] var" COLOR_RESET " Read a line into variables\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "true, false" COLOR_RESET "  Return success / failure\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "break, continue" COLOR_RESET " Loop control\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "export, unset" COLOR_RESET " Manage variables\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "set [-x|+x]" COLOR_RESET "  Toggle command tracing\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "set -- args" COLOR_RESET "  Replace $1..$N (shift drops $1)\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "memo [-i f] cmd" COLOR_RESET " Cache cmd's output until f changes\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "limit [-c %%] [-m size] cmd" COLOR_RESET " Run cmd with cgroup limits\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "cgstat" COLOR_RESET "       Resource totals of the last job\n");
+    fprintf(ctx->out, "\n");
+
+    fprintf(ctx->out, COLOR_YELLOW "Shell Control:\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "exit [code]" COLOR_RESET "  Exit shell (default: last status)\n");
+    fprintf(ctx->out, "  " COLOR_GREEN "exec [cmd] [n>file]" COLOR_RESET " Replace the shell / keep fds open\n");
+    fprintf(ctx->out, "\n");
+
+    fprintf(ctx->out, COLOR_CYAN "Features:\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Pipes: " COLOR_GREEN "cmd1 | cmd2 | cmd3\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Redirects: " COLOR_GREEN "> >> < 2>&1 3>>log >&3 3>&-  cmd > a > b | c\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Logical: " COLOR_GREEN "&& || ; !\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Quotes: " COLOR_GREEN "'single' \"double\" \\\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Variables: " COLOR_GREEN "name=value $name ${name} $?\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Arithmetic: " COLOR_GREEN "$((i + 1)) $((n *= 2)) $((a > b ? a : b))\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Control flow: " COLOR_GREEN "if/elif/else/fi for/in while until\n" COLOR_RESET);
+    fprintf(ctx->out, "  • Grouping: " COLOR_GREEN "{ a; b; } > out  (cd dir && make)\n" COLOR_RESET);
+    fprintf(ctx->out, "  • History: " COLOR_GREEN "!! !n !-n !prefix ^old^new\n" COLOR_RESET);
+    fprintf(ctx->out, "\n");
+
+    fprintf(ctx->out, COLOR_YELLOW "Examples:\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "ls | grep txt > files.txt\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "cat file.txt 2> errors.log\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "mkdir test && cd test && pwd\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "echo 'Hello World'\n" COLOR_RESET);
+    fprintf(ctx->out, "  " COLOR_GREEN "for f in a b c; do echo $f; done\n" COLOR_RESET);
+    fprintf(ctx->out, "\n");
+
+    return 0;
+}
+
+int test_unary_op(const char *op)
+{
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+           strchr("bcdefghLnprsStuwxz", op[1]) != NULL;
+}
+
+int test_binary_op(const char *op)
+{
+    static const char *ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le",
+                                "-gt", "-ge", "-nt", "-ot", NULL};
+    for (int i = 0; ops[i] != NULL; i++)
+    {
+        if (strcmp(op, ops[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+long long test_integer(TestState *ts, const char *s)
+{
+    char *end;
+    errno = 0;
+    long long value = strtoll(s, &end, 10);
+    while (isspace((unsigned char)*end))
+    {
+        end++;
+    }
+    if (*s == '\0' || *end != '\0' || errno != 0)
+    {
+        fprintf(ctx->err, "test: %s: integer expression expected\n", s);
+        ts->error = 1;
+    }
+    return value;
+}
+
+int test_unary(const char *op, const char *arg)
+{
+    struct stat st;
+
+    switch (op[1])
+    {
+    case 'z':
+        return arg[0] == '\0';
+    case 'n':
+        return arg[0] != '\0';
+    case 't':
+    {
+        // The shell's fd n, which need not be the process's fd n
+        int n = atoi(arg);
+        return n >= 0 && n < SHELL_FD_COUNT && ctx->fds[n] >= 0 && isatty(ctx->fds[n]);
+    }
+    }
+
+    arg = shell_path(arg);
+    switch (op[1])
+    {
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    }
+
+    if (stat(arg, &st) != 0)
+    {
+        return 0;
+    }
+
+    switch (op[1])
+    {
+    case 'e':
+        return 1;
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'u':
+        return (st.st_mode & S_ISUID) != 0;
+    case 'g':
+        return (st.st_mode & S_ISGID) != 0;
+    }
+    return 0;
+}
+
+int test_binary(TestState *ts, const char *left, const char *op, const char *right)
+{
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    {
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(op, "!=") == 0)
+    {
+        return strcmp(left, right) != 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0)
+    {
+        struct stat ls, rs;
+        int have_left = stat(shell_path(left), &ls) == 0;
+        int have_right = stat(shell_path(right), &rs) == 0;
+        if (op[1] == 'o')
+        {
+            return have_right && (!have_left || ls.st_mtime < rs.st_mtime);
+        }
+        return have_left && (!have_right || ls.st_mtime > rs.st_mtime);
+    }
+
+    long long a = test_integer(ts, left);
+    long long b = test_integer(ts, right);
+
+    if (strcmp(op, "-eq") == 0)
+    {
+        return a == b;
+    }
+    if (strcmp(op, "-ne") == 0)
+    {
+        return a != b;
+    }
+    if (strcmp(op, "-lt") == 0)
+    {
+        return a < b;
+    }
+    if (strcmp(op, "-le") == 0)
+    {
+        return a <= b;
+    }
+    if (strcmp(op, "-gt") == 0)
+    {
+        return a > b;
+    }
+    return a >= b;
+}
+
+int test_or(TestState *ts);
+
+int test_primary(TestState *ts)
+{
+    int remaining = ts->count - ts->pos;
+    char **args = ts->args + ts->pos;
+
+    if (remaining <= 0)
+    {
+        fprintf(ctx->err, "test: argument expected\n");
+        ts->error = 1;
+        return 0;
+    }
+
+    if (remaining >= 3 && test_binary_op(args[1]))
+    {
+        ts->pos += 3;
+        return test_binary(ts, args[0], args[1], args[2]);
+    }
+
+    if (strcmp(args[0], "!") == 0)
+    {
+        ts->pos++;
+        return !test_primary(ts);
+    }
+
+    if (strcmp(args[0], "(") == 0 && remaining >= 2)
+    {
+        ts->pos++;
+        int result = test_or(ts);
+        if (ts->pos >= ts->count || strcmp(ts->args[ts->pos], ")") != 0)
+        {
+            fprintf(ctx->err, "test: `)' expected\n");
+            ts->error = 1;
+            return 0;
+        }
+        ts->pos++;
+        return result;
+    }
+
+    if (remaining == 2 && test_binary_op(args[1]) && !test_unary_op(args[0]))
+    {
+        fprintf(ctx->err, "test: %s: argument expected\n", args[1]);
+        ts->error = 1;
+        return 0;
+    }
+
+    if (remaining >= 2 && test_unary_op(args[0]))
+    {
+        ts->pos += 2;
+        return test_unary(args[0], args[1]);
+    }
+
+    ts->pos++;
+    return args[0][0] != '\0';
+}
+
+int test_and(TestState *ts)
+{
+    int result = test_primary(ts);
+    while (ts->pos < ts->count && strcmp(ts->args[ts->pos], "-a") == 0)
+    {
+        ts->pos++;
+        int right = test_primary(ts);
+        result = result && right;
+    }
+    return result;
+}
+
+int test_or(TestState *ts)
+{
+    int result = test_and(ts);
+    while (ts->pos < ts->count && strcmp(ts->args[ts->pos], "-o") == 0)
+    {
+        ts->pos++;
+        int right = test_and(ts);
+        result = result || right;
+    }
+    return result;
+}
+
+int builtin_test(char **args)
+{
+    int argc = 0;
+    while (args[argc] != NULL)
+    {
+        argc++;
+    }
+
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (strcmp(args[argc - 1], "]") != 0)
+        {
+            fprintf(ctx->err, "[: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    TestState ts = {args, 1, argc, 0};
+    if (argc == 1)
+    {
+        return 1;
+    }
+
+    int result = test_or(&ts);
+    if (!ts.error && ts.pos != ts.count)
+    {
+        fprintf(ctx->err, "test: too many arguments\n");
+        ts.error = 1;
+    }
+    return ts.error ? 2 : !result;
+}
+
+// Prints the backslash escape starting just past the backslash at s and
+// returns the number of characters consumed. \c sets *stop.
+size_t print_escape(const char *s, int *stop)
+{
+    static const char plain[] = "abfnrtv\\\"'";
+    static const char codes[] = "\a\b\f\n\r\t\v\\\"'";
+    const char *hit = *s != '\0' ? strchr(plain, *s) : NULL;
+
+    if (hit != NULL)
+    {
+        fputc(codes[hit - plain], ctx->out);
+        return 1;
+    }
+
+    if (*s == 'c')
+    {
+        *stop = 1;
+        return 1;
+    }
+
+    if (*s >= '0' && *s <= '7')
+    {
+        size_t n = 0;
+        int value = 0;
+        // %b allows a leading 0 before up to three octal digits
+        if (*s == '0')
+        {
+            n++;
+        }
+        for (size_t start = n; n < start + 3 && s[n] >= '0' && s[n] <= '7'; n++)
+        {
+            value = value * 8 + (s[n] - '0');
+        }
+        fputc(value, ctx->out);
+        return n;
+    }
+
+    fputc('\\', ctx->out);
+    if (*s == '\0')
+    {
+        return 0;
+    }
+    fputc(*s, ctx->out);
+    return 1;
+}
+
+long long printf_number(const char *arg, int *result)
+{
+    if (arg == NULL || *arg == '\0')
+    {
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"')
+    {
+        return (unsigned char)arg[1];
+    }
+
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (*end != '\0' || errno != 0)
+    {
+        fprintf(ctx->err, "printf: %s: invalid number\n", arg);
+        *result = 1;
+    }
+    return value;
+}
+
+int builtin_printf(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(ctx->err, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    const char *format = args[1];
+    char **argp = &args[2];
+    char **pass_start;
+    int result = 0;
+    int stop = 0;
+
+    // The format is reused while unconsumed arguments remain
+    do
+    {
+        pass_start = argp;
+        const char *f = format;
+
+        while (*f != '\0' && !stop)
+        {
+            if (*f == '\\')
+            {
+                f++;
+                f += print_escape(f, &stop);
+                continue;
+            }
+            if (*f != '%')
+            {
+                fputc(*f++, ctx->out);
+                continue;
+            }
+            if (f[1] == '%')
+            {
+                fputc('%', ctx->out);
+                f += 2;
+                continue;
+            }
+
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = *f++;
+
+            while (*f != '\0' && strchr("-+ #0", *f) != NULL && n < 8)
+            {
+                spec[n++] = *f++;
+            }
+            for (int part = 0; part < 2; part++)
+            {
+                if (part == 1)
+                {
+                    if (*f != '.')
+                    {
+                        break;
+                    }
+                    spec[n++] = *f++;
+                }
+                if (*f == '*')
+                {
+                    const char *arg = *argp ? *argp++ : NULL;
+                    n += snprintf(spec + n, 16, "%d", (int)printf_number(arg, &result));
+                    f++;
+                }
+                while (isdigit((unsigned char)*f) && n < 40)
+                {
+                    spec[n++] = *f++;
+                }
+            }
+
+            char conv = *f;
+            if (conv == '\0')
+            {
+                fprintf(ctx->err, "printf: missing format character\n");
+                return 1;
+            }
+            f++;
+
+            const char *arg = *argp ? *argp++ : NULL;
+
+            if (strchr("diouxX", conv) != NULL)
+            {
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                long long value = printf_number(arg, &result);
+                if (conv == 'd' || conv == 'i')
+                {
+                    fprintf(ctx->out, spec, value);
+                }
+                else
+                {
+                    fprintf(ctx->out, spec, (unsigned long long)value);
+                }
+            }
+            else if (strchr("eEfFgG", conv) != NULL)
+            {
+                spec[n++] = conv;
+                spec[n] = '\0';
+                fprintf(ctx->out, spec, arg ? strtod(arg, NULL) : 0.0);
+            }
+            else if (conv == 's' || conv == 'c')
+            {
+                char first[2] = {arg ? arg[0] : '\0', '\0'};
+                spec[n++] = 's';
+                spec[n] = '\0';
+                fprintf(ctx->out, spec, conv == 'c' ? first : (arg ? arg : ""));
+            }
+            else if (conv == 'b')
+            {
+                for (const char *s = arg ? arg : ""; *s != '\0' && !stop;)
+                {
+                    if (*s == '\\')
+                    {
+                        s++;
+                        s += print_escape(s, &stop);
+                    }
+                    else
+                    {
+                        fputc(*s++, ctx->out);
+                    }
+                }
+            }
+            else
+            {
+                fprintf(ctx->err, "printf: %%%c: invalid directive\n", conv);
+                return 1;
+            }
+        }
+    } while (!stop && *argp != NULL && argp != pass_start);
+
+    return result;
+}
+
+// Reads up to a newline from fd without consuming anything past it, so
+// commands started after `read` still see the rest of their input.
+// Returns 0 on EOF before a newline.
+int read_physical_line(int fd, StrBuf *sb)
+{
+    char chunk[128];
+    int seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+
+    while (1)
+    {
+        ssize_t n = read(fd, chunk, seekable ? sizeof(chunk) : 1);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return 0;
+        }
+
+        char *newline = memchr(chunk, '\n', n);
+        if (newline != NULL)
+        {
+            sb_append(sb, chunk, newline - chunk);
+            if (seekable)
+            {
+                lseek(fd, (newline - chunk + 1) - n, SEEK_CUR);
+            }
+            return 1;
+        }
+        sb_append(sb, chunk, n);
+    }
+}
+
+int builtin_read(char **args)
+{
+    int raw = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        if (strcmp(args[i], "-r") == 0)
+        {
+            raw = 1;
+        }
+        else if (strcmp(args[i], "-p") == 0 && args[i + 1] != NULL)
+        {
+            fputs(args[++i], ctx->err);
+            fflush(ctx->err);
+        }
+        else if (strcmp(args[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        else
+        {
+            fprintf(ctx->err, "read: %s: invalid option\n", args[i]);
+            return 2;
+        }
+    }
+
+    StrBuf line = {NULL, 0, 0};
+    int found_newline;
+
+    sb_append(&line, "", 0);
+    while ((found_newline = read_physical_line(ctx->fds[0], &line)) && !raw)
+    {
+        // An odd number of trailing backslashes escapes the newline
+        size_t slashes = 0;
+        while (slashes < line.len && line.data[line.len - 1 - slashes] == '\\')
+        {
+            slashes++;
+        }
+        if (slashes % 2 == 0)
+        {
+            break;
+        }
+        line.data[--line.len] = '\0';
+    }
+
+    if (!raw)
+    {
+        size_t out = 0;
+        for (size_t in = 0; in < line.len; in++)
+        {
+            if (line.data[in] == '\\' && in + 1 < line.len)
+            {
+                in++;
+            }
+            line.data[out++] = line.data[in];
+        }
+        line.data[out] = '\0';
+        line.len = out;
+    }
+
+    static char *default_names[] = {"REPLY", NULL};
+    char **names = args[i] != NULL ? &args[i] : default_names;
+    const char *ifs = get_var("IFS");
+    char *p = line.data;
+
+    if (ifs == NULL)
+    {
+        ifs = " \t\n";
+    }
+
+    for (int n = 0; names[n] != NULL; n++)
+    {
+        while (*p != '\0' && strchr(ifs, *p) != NULL && isspace((unsigned char)*p))
+        {
+            p++;
+        }
+
+        if (names[n + 1] == NULL)
+        {
+            // The last variable takes the remainder of the line
+            size_t len = strlen(p);
+            while (len > 0 && strchr(ifs, p[len - 1]) != NULL && isspace((unsigned char)p[len - 1]))
+            {
+                len--;
+            }
+            p[len] = '\0';
+            set_var(names[n], p, 0);
+            break;
+        }
+
+        char *start = p;
+        while (*p != '\0' && strchr(ifs, *p) == NULL)
+        {
+            p++;
+        }
+        if (*p != '\0')
+        {
+            *p++ = '\0';
+        }
+        set_var(names[n], start, 0);
+    }
+
+    free(line.data);
+    return found_newline ? 0 : 1;
+}
+
+int builtin_loop_control(char **args)
+{
+    int levels = 1;
+
+    if (args[1] != NULL)
+    {
+        char *end;
+        levels = (int)strtol(args[1], &end, 10);
+        if (*end != '\0' || levels < 1)
+        {
+            fprintf(ctx->err, "%s: %s: loop count out of range\n", args[0], args[1]);
+            return 1;
+        }
+    }
+
+    if (ctx->loop_depth == 0)
+    {
+        fprintf(ctx->err, "%s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+        return 0;
+    }
+
+    if (levels > ctx->loop_depth)
+    {
+        levels = ctx->loop_depth;
+    }
+
+    if (strcmp(args[0], "break") == 0)
+    {
+        ctx->pending_break = levels;
+    }
+    else
+    {
+        ctx->pending_continue = levels;
+    }
+    return 0;
+}
+
+int builtin_export(char **args)
+{
+    if (args[1] == NULL)
+    {
+        for (int b = 0; b < VAR_BUCKETS; b++)
+        {
+            for (Var *v = ctx->vars[b]; v != NULL; v = v->next)
+            {
+                if (v->exported)
+                {
+                    fprintf(ctx->out, "export %s=\"%s\"\n", v->name, v->value);
+                }
+            }
+        }
+        return 0;
+    }
+
+    int result = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+
+        if (!is_valid_name(args[i], len))
+        {
+            fprintf(ctx->err, "export: `%s': not a valid identifier\n", args[i]);
+            result = 1;
+            continue;
+        }
+
+        if (eq != NULL)
+        {
+            char *name = arena_strndup(&ctx->scratch, args[i], len);
+            set_var(name, eq + 1, 1);
+        }
+        else if (find_var(args[i]) != NULL)
+        {
+            find_var(args[i])->exported = 1;
+        }
+    }
+    return result;
+}
+
+void set_positional(char **args, int count)
+{
+    char **copy = malloc((count + 1) * sizeof(char *));
+    if (copy == NULL)
+    {
+        shell_perror("set");
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        copy[i] = strdup(args[i]);
+    }
+    copy[count] = NULL;
+
+    for (int i = 0; i < ctx->positional_count; i++)
+    {
+        free(ctx->positional[i]);
+    }
+    free(ctx->positional);
+    ctx->positional = copy;
+    ctx->positional_count = count;
+}
+
+int builtin_shift(char **args)
+{
+    int n = args[1] != NULL ? atoi(args[1]) : 1;
+
+    if (n < 0 || n > ctx->positional_count)
+    {
+        fprintf(ctx->err, "shift: %s: shift count out of range\n", args[1] ? args[1] : "1");
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        free(ctx->positional[i]);
+    }
+    memmove(ctx->positional, ctx->positional + n, (ctx->positional_count - n + 1) * sizeof(char *));
+    ctx->positional_count -= n;
+    return 0;
+}
+
+int builtin_set(char **args)
+{
+    if (args[1] == NULL)
+    {
+        for (int b = 0; b < VAR_BUCKETS; b++)
+        {
+            for (Var *v = ctx->vars[b]; v != NULL; v = v->next)
+            {
+                fprintf(ctx->out, "%s=%s\n", v->name, v->value);
+            }
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-x") == 0 || strcmp(args[i], "+x") == 0)
+        {
+            ctx->xtrace = args[i][0] == '-';
+        }
+        else if (strcmp(args[i], "--") == 0 || (args[i][0] != '-' && args[i][0] != '+'))
+        {
+            int start = i + (strcmp(args[i], "--") == 0);
+            int count = 0;
+            while (args[start + count] != NULL)
+            {
+                count++;
+            }
+            set_positional(&args[start], count);
+            break;
+        }
+        else
+        {
+            fprintf(ctx->err, "set: %s: invalid option\n", args[i]);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+// cd for an embedded context, which must leave the process directory alone
+int change_context_dir(const char *path)
+{
+    struct stat st;
+    char *resolved = realpath(shell_path(path), NULL);
+
+    if (resolved == NULL || stat(resolved, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        if (resolved != NULL)
+        {
+            errno = ENOTDIR;
+        }
+        shell_perror("cd");
+        free(resolved);
+        return 1;
+    }
+
+    free(ctx->cwd);
+    ctx->cwd = resolved;
+    return 0;
+}
+
+// Ends the shell, or in an embedded context the current msh_exec
+int shell_exit(int status)
+{
+    if (ctx->in_subshell)
+    {
+        child_exit(status);
+    }
+
+    // An embedding program keeps running; only this msh_exec ends
+    if (ctx->embedded)
+    {
+        ctx->exiting = 1;
+        return status;
+    }
+
+    if (ctx->interactive)
+    {
+        save_history();
+        fprintf(ctx->out, COLOR_CYAN "\nGoodbye! 👋\n" COLOR_RESET);
+    }
+    free_history();
+    job_end(NULL);
+    close_fds();
+    exit(status);
+}
+
+// exec command: the command replaces the shell. Its redirections, and
+// those of a bare exec, were already made permanent by execute_builtin.
+int builtin_exec(char **args)
+{
+    Command cmd;
+
+    if (args[1] == NULL)
+    {
+        return 0;
+    }
+
+    command_from_argv(&args[1], &cmd);
+    // An embedding process can't be replaced; run it and end instead
+    ctx->tail_exec = !ctx->embedded;
+    int status = execute_pipeline(&cmd, 1);
+    ctx->tail_exec = 0;
+    return shell_exit(status);
+}
+
+int run_builtin(char **args)
+{
+    int result = 0;
+
+    if (strcmp(args[0], "exit") == 0)
+    {
+        result = shell_exit(args[1] != NULL ? atoi(args[1]) : ctx->shell_status);
+    }
+    else if (strcmp(args[0], "exec") == 0)
+    {
+        result = builtin_exec(args);
+    }
+    else if (strcmp(args[0], "help") == 0)
+    {
+        result = builtin_help();
+    }
+    else if (strcmp(args[0], "clear") == 0)
+    {
+        fprintf(ctx->out, "\033[2J\033[H");
+        fflush(ctx->out);
+    }
+    else if (strcmp(args[0], "history") == 0)
+    {
+        for (int i = 0; i < ctx->history_count; i++)
+        {
+            fprintf(ctx->out, "%4d  %s\n", i + 1, ctx->history[i]);
+        }
+    }
+    else if (strcmp(args[0], "echo") == 0)
+    {
+        for (int i = 1; args[i] != NULL; i++)
+        {
+            if (i > 1)
+            {
+                fprintf(ctx->out, " ");
+            }
+            fprintf(ctx->out, "%s", args[i]);
+        }
+        fprintf(ctx->out, "\n");
+    }
+    else if (strcmp(args[0], "pwd") == 0)
+    {
+        char cwd[BUFFER_SIZE];
+        if (ctx->cwd != NULL)
+        {
+            fprintf(ctx->out, "%s\n", ctx->cwd);
+        }
+        else if (getcwd(cwd, sizeof(cwd)) != NULL)
+        {
+            fprintf(ctx->out, "%s\n", cwd);
+        }
+        else
+        {
+            shell_perror("pwd");
+            result = 1;
+        }
+    }
+    else if (strcmp(args[0], "cd") == 0)
+    {
+        const char *path;
+
+        if (args[1] == NULL || strcmp(args[1], "~") == 0)
+        {
+            path = get_var("HOME");
+            if (path == NULL)
+            {
+                fprintf(ctx->err, "cd: HOME not set\n");
+                return 1;
+            }
+        }
+        else
+        {
+            path = args[1];
+        }
+
+        if (ctx->cwd != NULL)
+        {
+            result = change_context_dir(path);
+        }
+        else if (chdir(path) != 0)
+        {
+            shell_perror("cd");
+            result = 1;
+        }
+    }
+    else if (strcmp(args[0], "type") == 0)
+    {
+        if (args[1] == NULL)
+        {
+            fprintf(ctx->err, "type: missing argument\n");
+            return 1;
+        }
+
+        if (is_builtin(args[1]))
+        {
+            fprintf(ctx->out, "%s is a shell builtin\n", args[1]);
+            return 0;
+        }
+
+        const char *path = get_var("PATH");
+        if (path == NULL)
+        {
+            fprintf(ctx->out, "%s: not found\n", args[1]);
+            return 1;
+        }
+
+        char *path_copy = strdup(path);
+        if (path_copy == NULL)
+        {
+            shell_perror("strdup");
+            return 1;
+        }
+
+        char *save = NULL;
+        char *dir = strtok_r(path_copy, ":", &save);
+        int found = 0;
+
+        while (dir != NULL)
+        {
+            char full_path[BUFFER_SIZE];
+            snprintf(full_path, sizeof(full_path), "%s/%s", dir, args[1]);
+
+            if (access(full_path, X_OK) == 0)
+            {
+                fprintf(ctx->out, "%s is %s\n", args[1], full_path);
+                found = 1;
+                break;
+            }
+            dir = strtok_r(NULL, ":", &save);
+        }
+
+        if (!found)
+        {
+            fprintf(ctx->out, "%s: not found\n", args[1]);
+            result = 1;
+        }
+
+        free(path_copy);
+    }
+    else if (strcmp(args[0], "true") == 0)
+    {
+        result = 0;
+    }
+    else if (strcmp(args[0], "false") == 0)
+    {
+        result = 1;
+    }
+    else if (strcmp(args[0], "test") == 0 || strcmp(args[0], "[") == 0)
+    {
+        result = builtin_test(args);
+    }
+    else if (strcmp(args[0], "printf") == 0)
+    {
+        result = builtin_printf(args);
+    }
+    else if (strcmp(args[0], "read") == 0)
+    {
+        result = builtin_read(args);
+    }
+    else if (strcmp(args[0], "break") == 0 || strcmp(args[0], "continue") == 0)
+    {
+        result = builtin_loop_control(args);
+    }
+    else if (strcmp(args[0], "export") == 0)
+    {
+        result = builtin_export(args);
+    }
+    else if (strcmp(args[0], "set") == 0)
+    {
+        result = builtin_set(args);
+    }
+    else if (strcmp(args[0], "shift") == 0)
+    {
+        result = builtin_shift(args);
+    }
+    else if (strcmp(args[0], "memo") == 0)
+    {
+        result = builtin_memo(args);
+    }
+    else if (strcmp(args[0], "limit") == 0)
+    {
+        result = builtin_limit(args);
+    }
+    else if (strcmp(args[0], "cgstat") == 0)
+    {
+        result = builtin_cgstat();
+    }
+    else if (strcmp(args[0], "unset") == 0)
+    {
+        for (int i = 1; args[i] != NULL; i++)
+        {
+            unset_var(args[i]);
+        }
+    }
+
+    return result;
+}
+
+// Closes the fd the context has for n, with its stream for 1 and 2
+void close_slot(int n)
+{
+    if (n == 1 || n == 2)
+    {
+        fclose(n == 1 ? ctx->out : ctx->err);
+    }
+    else if (ctx->fds[n] >= 0)
+    {
+        close(ctx->fds[n]);
+    }
+}
+
+ssize_t closed_write(void *cookie, const char *buf, size_t size)
+{
+    (void)cookie;
+    (void)buf;
+    (void)size;
+    errno = EBADF;
+    return -1;
+}
+
+// Stands in for a closed stdout or stderr so builtins can keep writing
+FILE *closed_stream(void)
+{
+    cookie_io_functions_t io = {NULL, closed_write, NULL, NULL};
+    return fopencookie(NULL, "w", io);
+}
+
+// Waits for the copier that read from the pipe slot n just closed,
+// unless another fd still writes to that pipe and takes it over
+void release_copier(int n, pid_t copier, struct stat *pipe_st)
+{
+    struct stat st;
+
+    for (int m = 0; m < SHELL_FD_COUNT; m++)
+    {
+        if (m != n && ctx->fds[m] >= 0 && fstat(ctx->fds[m], &st) == 0 &&
+            st.st_dev == pipe_st->st_dev && st.st_ino == pipe_st->st_ino)
+        {
+            ctx->copiers[m] = copier;
+            return;
+        }
+    }
+    while (waitpid(copier, NULL, 0) < 0 && errno == EINTR)
+    {
+    }
+}
+
+// Closes every fd the shell owns and waits for the copiers exec left, so
+// they have written everything out before the shell goes away
+void close_fds(void)
+{
+    fflush(ctx->out);
+    fflush(ctx->err);
+    for (int n = 0; n < SHELL_FD_COUNT; n++)
+    {
+        if (ctx->owned_fds & (1u << n))
+        {
+            close_slot(n);
+            ctx->fds[n] = -1;
+        }
+    }
+    ctx->owned_fds = 0;
+    for (int n = 0; n < SHELL_FD_COUNT; n++)
+    {
+        while (ctx->copiers[n] > 0 && waitpid(ctx->copiers[n], NULL, 0) < 0 && errno == EINTR)
+        {
+        }
+        ctx->copiers[n] = 0;
+    }
+}
+
+// Makes fd, which the shell owns (-1 to close), the context's fd n. The
+// fd it replaces is closed unless saved holds it for a later restore;
+// with saved NULL the change is permanent (exec).
+int replace_fd(int n, int fd, SavedFds *saved)
+{
+    unsigned int bit = 1u << n;
+    FILE *stream = NULL;
+
+    if (n >= 3 && fd >= 0 && fd < SHELL_FD_COUNT)
+    {
+        // Children dup2 onto 3..9; keep those numbers free
+        int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_COUNT);
+        close(fd);
+        if ((fd = moved) < 0)
+        {
+            shell_perror("fcntl");
+            return -1;
+        }
+    }
+    if (n == 1 || n == 2)
+    {
+        stream = fd >= 0 ? fdopen(fd, "w") : closed_stream();
+        if (stream == NULL)
+        {
+            shell_perror("fdopen");
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return -1;
+        }
+        if (n == 2)
+        {
+            setvbuf(stream, NULL, _IONBF, 0);
+        }
+        fflush(n == 1 ? ctx->out : ctx->err);
+    }
+
+    if ((saved == NULL || (saved->changed & bit)) && (ctx->owned_fds & bit))
+    {
+        struct stat old;
+        pid_t copier = saved == NULL ? ctx->copiers[n] : 0;
+        if (copier > 0 && fstat(ctx->fds[n], &old) != 0)
+        {
+            copier = 0;
+        }
+        close_slot(n);
+        if (saved == NULL)
+        {
+            ctx->copiers[n] = 0;
+        }
+        if (copier > 0)
+        {
+            release_copier(n, copier, &old);
+        }
+    }
+    if (saved != NULL)
+    {
+        saved->changed |= bit;
+    }
+    ctx->fds[n] = fd;
+    ctx->owned_fds |= bit;
+    if (n == 1)
+    {
+        ctx->out = stream;
+    }
+    else if (n == 2)
+    {
+        ctx->err = stream;
+    }
+    return 0;
+}
+
+void save_fds(SavedFds *saved)
+{
+    memcpy(saved->fds, ctx->fds, sizeof(saved->fds));
+    saved->out = ctx->out;
+    saved->err = ctx->err;
+    saved->owned = ctx->owned_fds;
+    saved->changed = 0;
+    memset(saved->copiers, 0, sizeof(saved->copiers));
+}
+
+// Puts back every fd the scope redirected; fds exec changed meanwhile stay
+void restore_redirections(SavedFds *saved)
+{
+    fflush(ctx->out);
+    fflush(ctx->err);
+
+    for (int n = 0; n < SHELL_FD_COUNT; n++)
+    {
+        unsigned int bit = 1u << n;
+        if (!(saved->changed & bit))
+        {
+            continue;
+        }
+        if (ctx->owned_fds & bit)
+        {
+            close_slot(n);
+        }
+        ctx->fds[n] = saved->fds[n];
+        ctx->owned_fds = (ctx->owned_fds & ~bit) | (saved->owned & bit);
+    }
+    if (saved->changed & (1u << 1))
+    {
+        ctx->out = saved->out;
+    }
+    if (saved->changed & (1u << 2))
+    {
+        ctx->err = saved->err;
+    }
+
+    // Closing the fds above ended the copiers' input
+    for (int n = 0; n < SHELL_FD_COUNT; n++)
+    {
+        while (saved->copiers[n] > 0 && waitpid(saved->copiers[n], NULL, 0) < 0 && errno == EINTR)
+        {
+        }
+    }
+}
+
+// Opens a redirection target for the shell itself; close-on-exec since
+// children get it by dup2
+int open_redirection(const char *path, int flags)
+{
+    int fd = open(shell_path(path), flags | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        shell_perror(path);
+    }
+    return fd;
+}
+
+int redirect_flags(const Redirect *r)
+{
+    if (r->type == REDIR_IN)
+    {
+        return O_RDONLY;
+    }
+    return O_WRONLY | O_CREAT | (r->type == REDIR_APPEND ? O_APPEND : O_TRUNC);
+}
+
+// The fd a REDIR_DUP copies, or -1 after reporting a bad one
+int redirect_source(const Redirect *r)
+{
+    if (!isdigit((unsigned char)r->target[0]) || r->target[1] != '\0')
+    {
+        fprintf(ctx->err, "%s: %s\n", r->target, strerror(EBADF));
+        return -1;
+    }
+    return r->target[0] - '0';
+}
+
+// Several files for one output fd are applied together, at the first of
+// them (multios). Returns how many there are, filling *list, when the
+// redirection at index is that first one; 0 if it was already applied.
+int output_group(Command *cmd, int index, Redirect **list)
+{
+    Redirect *r = &cmd->redirs[index];
+    int count = 0;
+
+    for (int i = 0; i < cmd->num_redirs; i++)
+    {
+        Redirect *other = &cmd->redirs[i];
+        if (other->fd != r->fd || (other->type != REDIR_OUT && other->type != REDIR_APPEND))
+        {
+            continue;
+        }
+        if (i < index)
+        {
+            return 0;
+        }
+        count++;
+    }
+
+    *list = arena_alloc(&ctx->scratch, count * sizeof(Redirect));
+    count = 0;
+    for (int i = index; i < cmd->num_redirs; i++)
+    {
+        Redirect *other = &cmd->redirs[i];
+        if (other->fd == r->fd && (other->type == REDIR_OUT || other->type == REDIR_APPEND))
+        {
+            (*list)[count++] = *other;
+        }
+    }
+    return count;
+}
+
+// Moves up to n bytes from pipe from to target, by splice where the kernel
+// allows it and through a buffer otherwise. A target that fails is dropped
+// but its bytes are still consumed. Returns 0 at the end of the input.
+ssize_t multios_move(int from, MultiosTarget *target, size_t n)
+{
+    char buf[MULTIOS_PIPE_SIZE];
+
+    for (;;)
+    {
+        if (target->fd >= 0 && !target->copy)
+        {
+            ssize_t moved = splice(from, NULL, target->fd, NULL, n, SPLICE_F_MOVE);
+            if (moved >= 0)
+            {
+                return moved;
+            }
+            if (errno == EINVAL)
+            {
+                target->copy = 1;
+            }
+            else if (errno != EINTR)
+            {
+                target->fd = -1;
+            }
+            continue;
+        }
+
+        ssize_t got = read(from, buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got > 0 && target->fd >= 0 && write_all(target->fd, buf, got) != 0)
+        {
+            target->fd = -1;
+        }
+        return got;
+    }
+}
+
+// Copies everything written to pipe in to each target until its writers
+// close it. Each round tee(2) duplicates the pending bytes into every relay
+// and splice then moves them on, so the data stays in pipe buffers.
+void multios_copy(int in, MultiosTarget *targets, int count)
+{
+    // A reader that goes away only drops its own target
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;)
+    {
+        size_t n = 0;
+        int live = targets[0].fd >= 0;
+
+        for (int k = 1; k < count; k++)
+        {
+            targets[k].pending = 0;
+            if (targets[k].fd < 0)
+            {
+                continue;
+            }
+            live = 1;
+
+            // Relays are drained every round and as large as in, so each
+            // tee after the first copies the same n bytes
+            ssize_t teed = tee(in, targets[k].relay[1], n > 0 ? n : MULTIOS_PIPE_SIZE, 0);
+            if (teed < 0 && errno == EINTR)
+            {
+                k--;
+                continue;
+            }
+            if (teed <= 0)
+            {
+                return;
+            }
+            if (n > 0 && (size_t)teed != n)
+            {
+                fprintf(ctx->err, "multios: short copy\n");
+                return;
+            }
+            n = teed;
+            targets[k].pending = teed;
+        }
+        if (!live)
+        {
+            return;
+        }
+
+        if (n == 0)
+        {
+            // Only the first target is left
+            if (multios_move(in, &targets[0], MULTIOS_PIPE_SIZE) <= 0)
+            {
+                return;
+            }
+            continue;
+        }
+
+        targets[0].pending = n;
+        for (int k = 0; k < count; k++)
+        {
+            int from = k == 0 ? in : targets[k].relay[0];
+            while (targets[k].pending > 0)
+            {
+                ssize_t moved = multios_move(from, &targets[k], targets[k].pending);
+                if (moved <= 0)
+                {
+                    return;
+                }
+                targets[k].pending -= moved;
+            }
+        }
+    }
+}
+
+int multios_pipe(int fds[2])
+{
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        return -1;
+    }
+    // Pin every pipe to the same size; tee relies on relays matching in
+    fcntl(fds[0], F_SETPIPE_SZ, MULTIOS_PIPE_SIZE);
+    fcntl(fds[1], F_SETPIPE_SZ, MULTIOS_PIPE_SIZE);
+    return 0;
+}
+
+// Closes what the process writing to a multios pipe does not need
+void multios_release(MultiosTarget *targets, int count, int total)
+{
+    for (int k = 0; k < total; k++)
+    {
+        if (k < count && targets[k].fd >= 0)
+        {
+            close(targets[k].fd);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (targets[k].relay[i] >= 0)
+            {
+                close(targets[k].relay[i]);
+            }
+        }
+    }
+}
+
+// Starts a copier fanning a bounded pipe out to every target in list, and
+// to keep_fd when it is >= 0. Returns the pipe's write end, or -1 after
+// reporting an error. The copier is a child whose pid is stored in
+// *copier; with copier NULL the calling process becomes the copier instead
+// and exits with the status of the child that returns, so a pipeline
+// stage is only reaped once all of its output is written.
+int multios_start(Redirect *list, int count, int keep_fd, pid_t *copier)
+{
+    int total = count + (keep_fd >= 0);
+    MultiosTarget *targets = arena_alloc(&ctx->scratch, total * sizeof(MultiosTarget));
+    int fds[2] = {-1, -1};
+    int ok = 1;
+
+    for (int k = 0; k < total; k++)
+    {
+        targets[k].fd = -1;
+        targets[k].relay[0] = -1;
+        targets[k].relay[1] = -1;
+        targets[k].copy = 0;
+        targets[k].pending = 0;
+    }
+    for (int k = 0; k < count && ok; k++)
+    {
+        targets[k].fd = open_redirection(list[k].target, redirect_flags(&list[k]));
+        ok = targets[k].fd >= 0;
+    }
+    if (keep_fd >= 0)
+    {
+        targets[count].fd = keep_fd;
+    }
+    for (int k = 1; k <= total && ok; k++)
+    {
+        // The last pipe made is the one the command writes to
+        if (multios_pipe(k < total ? targets[k].relay : fds) != 0)
+        {
+            shell_perror("pipe");
+            ok = 0;
+        }
+    }
+    if (!ok)
+    {
+        multios_release(targets, count, total);
+        if (fds[0] >= 0)
+        {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        return -1;
+    }
+
+    pid_t pid = fork_child();
+    if (pid < 0)
+    {
+        shell_perror("fork");
+        multios_release(targets, count, total);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if ((pid == 0) == (copier != NULL))
+    {
+        close(fds[1]);
+        if (copier == NULL)
+        {
+            close(STDIN_FILENO);
+        }
+        multios_copy(fds[0], targets, total);
+        close(fds[0]);
+        if (copier != NULL)
+        {
+            child_exit(0);
+        }
+
+        int status;
+        while (waitpid(pid, &status, 0) < 0)
+        {
+            if (errno != EINTR)
+            {
+                child_exit(1);
+            }
+        }
+        if (WIFSIGNALED(status))
+        {
+            // Die the same way so the shell reports the command's signal
+            signal(WTERMSIG(status), SIG_DFL);
+            kill(getpid(), WTERMSIG(status));
+        }
+        child_exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+    }
+
+    multios_release(targets, count, total);
+    close(fds[0]);
+    if (copier != NULL)
+    {
+        *copier = pid;
+    }
+    return fds[1];
+}
+
+// Applies cmd's redirections, in order, to the context's fds and streams.
+// The originals are kept in saved, or with saved NULL (exec) released.
+int redirect_fds(Command *cmd, SavedFds *saved)
+{
+    fflush(ctx->out);
+    fflush(ctx->err);
+
+    for (int i = 0; i < cmd->num_redirs; i++)
+    {
+        Redirect *r = &cmd->redirs[i];
+        Redirect *list;
+        pid_t copier = 0;
+        int fd = -1;
+
+        if (r->type == REDIR_DUP)
+        {
+            int source = redirect_source(r);
+            if (source < 0)
+            {
+                return 1;
+            }
+            if (source == 1 || source == 2)
+            {
+                fflush(source == 1 ? ctx->out : ctx->err);
+            }
+            // A copy of its own, so either side can be closed alone
+            fd = ctx->fds[source] >= 0 ? fcntl(ctx->fds[source], F_DUPFD_CLOEXEC, r->fd >= 3 ? SHELL_FD_COUNT : 0) : -1;
+            if (fd < 0)
+            {
+                fprintf(ctx->err, "%d: %s\n", source, strerror(ctx->fds[source] >= 0 ? errno : EBADF));
+                return 1;
+            }
+        }
+        else if (r->type == REDIR_IN)
+        {
+            fd = open_redirection(r->target, O_RDONLY);
+        }
+        else if (r->type != REDIR_CLOSE)
+        {
+            int count = output_group(cmd, i, &list);
+            if (count == 0)
+            {
+                continue;
+            }
+            if (count == 1)
+            {
+                fd = open_redirection(r->target, redirect_flags(r));
+            }
+            else
+            {
+                fd = multios_start(list, count, -1, saved != NULL ? &saved->copiers[r->fd] : &copier);
+            }
+        }
+        if (fd < 0 && r->type != REDIR_CLOSE)
+        {
+            return 1;
+        }
+        if (replace_fd(r->fd, fd, saved) != 0)
+        {
+            return 1;
+        }
+        // exec's copiers live as long as the fd they feed
+        if (copier > 0)
+        {
+            ctx->copiers[r->fd] = copier;
+        }
+    }
+    return 0;
+}
+
+// Applies cmd's redirections for the duration of a builtin or compound
+// command, remembering the originals in saved
+int apply_redirections(Command *cmd, SavedFds *saved)
+{
+    save_fds(saved);
+    if (redirect_fds(cmd, saved) != 0)
+    {
+        restore_redirections(saved);
+        return 1;
+    }
+    return 0;
+}
+
+int execute_builtin(Command *cmd)
+{
+    SavedFds saved;
+
+    // exec's redirections outlast it
+    if (strcmp(cmd->args[0], "exec") == 0)
+    {
+        if (redirect_fds(cmd, NULL) != 0)
+        {
+            return 1;
+        }
+        return run_builtin(cmd->args);
+    }
+
+    if (apply_redirections(cmd, &saved) != 0)
+    {
+        return 1;
+    }
+
+    long long started = ctx->trace.fd >= 0 ? now_us(CLOCK_MONOTONIC) : 0;
+    int result = run_builtin(cmd->args);
+
+    restore_redirections(&saved);
+
+    if (ctx->trace.fd >= 0)
+    {
+        trace_begin("builtin");
+        trace_argv(cmd->args);
+        trace_printf(",\"status\":%d,\"wall_us\":%lld", result, now_us(CLOCK_MONOTONIC) - started);
+        trace_end();
+    }
+    return result;
+}
+
+// Consumes one level of a pending break/continue; returns 1 if the
+// innermost loop must stop iterating.
+int loop_finished(void)
+{
+    if (ctx->exiting)
+    {
+        return 1;
+    }
+    if (ctx->pending_break > 0)
+    {
+        ctx->pending_break--;
+        return 1;
+    }
+    if (ctx->pending_continue > 0)
+    {
+        ctx->pending_continue--;
+        return ctx->pending_continue > 0;
+    }
+    return 0;
+}
+
+int run_compound(Compound *c)
+{
+    int status = 0;
+    int tail = ctx->tail_exec;
+
+    // Only a body that runs last may exec its final command; loops repeat
+    ctx->tail_exec = 0;
+
+    if (c->type == COMPOUND_BRACE || c->type == COMPOUND_SUBSHELL)
+    {
+        ctx->tail_exec = tail;
+        return execute(c->body);
+    }
+
+    if (c->type == COMPOUND_IF)
+    {
+        int cond = execute(c->cond);
+        if (ctx->pending_break > 0 || ctx->pending_continue > 0 || ctx->exiting)
+        {
+            return cond;
+        }
+        ctx->tail_exec = tail;
+        if (cond == 0)
+        {
+            return execute(c->body);
+        }
+        status = c->else_body != NULL ? execute(c->else_body) : 0;
+        ctx->tail_exec = 0;
+        return status;
+    }
+
+    ctx->loop_depth++;
+
+    if (c->type == COMPOUND_FOR)
+    {
+        ArenaMark mark = arena_mark(&ctx->scratch);
+        WordList words = {NULL, 0, 0};
+
+        ctx->expansion_failed = 0;
+        for (int i = 0; c->words != NULL && c->words[i] != NULL; i++)
+        {
+            expand_word(c->words[i], &words, 1);
+        }
+        if (c->words == NULL)
+        {
+            expand_word("\"$@\"", &words, 1);
+        }
+        if (ctx->expansion_failed)
+        {
+            words.count = 0;
+            status = 1;
+        }
+
+        for (int i = 0; i < words.count; i++)
+        {
+            set_var(c->var, words.items[i], 0);
+            status = execute(c->body);
+            if (loop_finished())
+            {
+                break;
+            }
+        }
+
+        arena_release(&ctx->scratch, mark);
+    }
+    else
+    {
+        while (1)
+        {
+            int cond = execute(c->cond);
+            if (loop_finished() || (cond == 0) != (c->type == COMPOUND_WHILE))
+            {
+                break;
+            }
+            status = execute(c->body);
+            if (loop_finished())
+            {
+                break;
+            }
+        }
+    }
+
+    ctx->loop_depth--;
+    return status;
+}
+
+void execute_command(Command *cmd, int input_fd, int output_fd)
+{
+    int fds[SHELL_FD_COUNT];
+    int piped = output_fd != ctx->fds[1];
+
+    // Pipe ends can land on 3-9 too; move them out of the way first
+    if (input_fd != ctx->fds[0] && input_fd < SHELL_FD_COUNT)
+    {
+        int moved = fcntl(input_fd, F_DUPFD, SHELL_FD_COUNT);
+        close(input_fd);
+        input_fd = moved;
+    }
+    if (piped && output_fd < SHELL_FD_COUNT)
+    {
+        int moved = fcntl(output_fd, F_DUPFD, SHELL_FD_COUNT);
+        close(output_fd);
+        output_fd = moved;
+    }
+
+    memcpy(fds, ctx->fds, sizeof(fds));
+    fds[0] = input_fd;
+    fds[1] = output_fd;
+
+    if (ctx->cwd != NULL && chdir(ctx->cwd) != 0)
+    {
+        shell_perror(ctx->cwd);
+        child_exit(1);
+    }
+
+    // From here on the child works on the process's own fds 0-9. Shell
+    // fds above 2 live above 9, so no dup2 overwrites one still to come.
+    for (int i = 0; i < SHELL_FD_COUNT; i++)
+    {
+        if (fds[i] >= 0 && fds[i] != i)
+        {
+            dup2(fds[i], i);
+        }
+        else if (fds[i] < 0 && i < 3)
+        {
+            close(i);
+        }
+    }
+    if (input_fd != ctx->fds[0])
+    {
+        close(input_fd);
+    }
+    if (output_fd != ctx->fds[1])
+    {
+        close(output_fd);
+    }
+    for (int i = 0; i < SHELL_FD_COUNT; i++)
+    {
+        ctx->fds[i] = fds[i] >= 0 ? i : -1;
+    }
+    ctx->owned_fds = 0;
+    ctx->out = stdout;
+    ctx->err = stderr;
+
+    for (int i = 0; i < cmd->num_redirs; i++)
+    {
+        Redirect *r = &cmd->redirs[i];
+        Redirect *list;
+        int fd = -1;
+
+        // ctx->fds follows along: fd n is open exactly when it is n here.
+        // Other fds below 10 are the shell's own and must not be copied.
+        if (r->type == REDIR_CLOSE)
+        {
+            close(r->fd);
+            ctx->fds[r->fd] = -1;
+            continue;
+        }
+        if (r->type == REDIR_DUP)
+        {
+            int source = redirect_source(r);
+            if (source < 0)
+            {
+                child_exit(1);
+            }
+            if (ctx->fds[source] < 0 || (source != r->fd && dup2(source, r->fd) < 0))
+            {
+                fprintf(ctx->err, "%d: %s\n", source, strerror(ctx->fds[source] >= 0 ? errno : EBADF));
+                child_exit(1);
+            }
+            ctx->fds[r->fd] = r->fd;
+            continue;
+        }
+
+        int count = r->type == REDIR_IN ? 1 : output_group(cmd, i, &list);
+        if (count == 0)
+        {
+            continue;
+        }
+        if (count == 1)
+        {
+            fd = open(r->target, redirect_flags(r), 0644);
+            if (fd < 0)
+            {
+                shell_perror(r->target);
+            }
+        }
+        else
+        {
+            // As in zsh, a stage feeding a pipe keeps writing to it too
+            fd = multios_start(list, count, r->fd == 1 && piped ? STDOUT_FILENO : -1, NULL);
+        }
+        if (fd < 0)
+        {
+            child_exit(1);
+        }
+        if (fd != r->fd)
+        {
+            dup2(fd, r->fd);
+            close(fd);
+        }
+        ctx->fds[r->fd] = r->fd;
+    }
+
+    // Pipeline stages that are builtins or compounds run in this child,
+    // whose last command can then replace it
+    ctx->in_subshell = 1;
+    if (cmd->compound != NULL)
+    {
+        ctx->tail_exec = 1;
+        child_exit(run_compound(cmd->compound));
+    }
+    if (cmd->args[0] == NULL)
+    {
+        child_exit(0);
+    }
+    if (is_builtin(cmd->args[0]))
+    {
+        child_exit(run_builtin(cmd->args));
+    }
+
+    if (ctx->trace.fd >= 0)
+    {
+        trace_begin("exec");
+        trace_argv(cmd->args);
+        trace_end();
+        trace_flush();
+    }
+
+    environ = build_envp();
+    execvp(cmd->args[0], cmd->args);
+    fprintf(ctx->err, "%s: command not found\n", cmd->args[0]);
+    child_exit(127);
+}
+
+void trace_spawn(pid_t pid, int stage)
+{
+    if (ctx->trace.fd >= 0)
+    {
+        trace_begin("spawn");
+        trace_printf(",\"child\":%d,\"stage\":%d", (int)pid, stage);
+        trace_end();
+    }
+}
+
+// Reaps one pipeline stage, logging its rusage when tracing
+int wait_status(pid_t pid, int stage, long long spawned)
+{
+    int status;
+    struct rusage usage;
+
+    script_prefetch(ctx->script);
+    while (wait4(pid, &status, 0, &usage) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return 1;
+        }
+    }
+
+    int result = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    if (WIFSIGNALED(status))
+    {
+        ctx->child_signaled = 1;
+    }
+
+    if (ctx->trace.fd >= 0)
+    {
+        trace_begin("exit");
+        trace_printf(",\"child\":%d,\"stage\":%d,\"status\":%d,\"signal\":%d",
+                     (int)pid, stage, result, WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+        trace_printf(",\"wall_us\":%lld,\"utime_us\":%lld,\"stime_us\":%lld,\"maxrss_kb\":%ld",
+                     now_us(CLOCK_MONOTONIC) - spawned,
+                     (long long)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec,
+                     (long long)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec,
+                     usage.ru_maxrss);
+        trace_end();
+    }
+    return result;
+}
+
+// Runs a lone simple command: builtins and assignments stay in-process.
+// With tail set the shell has nothing left to do, so an external command
+// replaces it rather than being forked and waited for.
+int execute_simple(Command *raw, int tail)
+{
+    Command cmd;
+    WordList assigns = {NULL, 0, 0};
+
+    if (expand_command(raw, &cmd, &assigns) != 0)
+    {
+        return 1;
+    }
+
+    if (cmd.args[0] == NULL)
+    {
+        SavedFds saved;
+        for (int i = 0; i < assigns.count; i++)
+        {
+            if (apply_assignment(assigns.items[i], 0) != 0)
+            {
+                return 1;
+            }
+        }
+        if (ctx->xtrace && assigns.count > 0)
+        {
+            xtrace_print(&assigns, cmd.args);
+        }
+        if (apply_redirections(&cmd, &saved) != 0)
+        {
+            return 1;
+        }
+        restore_redirections(&saved);
+        return 0;
+    }
+
+    if (is_builtin(cmd.args[0]))
+    {
+        // Prefix assignments only last for the builtin
+        Var saved_vars[assigns.count > 0 ? assigns.count : 1];
+        int applied = 0;
+        int result = 1;
+
+        while (applied < assigns.count)
+        {
+            int i = applied;
+            const char *eq = strchr(assigns.items[i], '=');
+            char *name = arena_strndup(&ctx->scratch, assigns.items[i], eq - assigns.items[i]);
+            Var *old = find_var(name);
+            saved_vars[i].name = name;
+            saved_vars[i].value = old ? arena_strndup(&ctx->scratch, old->value, strlen(old->value)) : NULL;
+            saved_vars[i].exported = old ? old->exported : 0;
+            if (apply_assignment(assigns.items[i], 0) != 0)
+            {
+                break;
+            }
+            applied++;
+        }
+
+        if (applied == assigns.count)
+        {
+            if (ctx->xtrace)
+            {
+                xtrace_print(&assigns, cmd.args);
+            }
+            result = execute_builtin(&cmd);
+        }
+
+        for (int i = applied - 1; i >= 0; i--)
+        {
+            if (saved_vars[i].value == NULL)
+            {
+                unset_var(saved_vars[i].name);
+            }
+            else
+            {
+                set_var(saved_vars[i].name, saved_vars[i].value, saved_vars[i].exported);
+            }
+        }
+        return result;
+    }
+
+    long long spawned = ctx->trace.fd >= 0 ? now_us(CLOCK_MONOTONIC) : 0;
+    pid_t pid = tail && !copiers_running() ? 0 : fork_child();
+    if (pid == 0)
+    {
+        for (int i = 0; i < assigns.count; i++)
+        {
+            if (apply_assignment(assigns.items[i], 1) != 0)
+            {
+                child_exit(1);
+            }
+        }
+        if (ctx->xtrace)
+        {
+            xtrace_print(&assigns, cmd.args);
+        }
+        execute_command(&cmd, ctx->fds[0], ctx->fds[1]);
+    }
+    else if (pid > 0)
+    {
+        trace_spawn(pid, 0);
+        return wait_status(pid, 0, spawned);
+    }
+    else
+    {
+        shell_perror("fork");
+    }
+    return 1;
+}
+
+// Runs a subshell that changes shell state in a child of its own
+int execute_subshell(Command *cmd, int tail)
+{
+    long long spawned = ctx->trace.fd >= 0 ? now_us(CLOCK_MONOTONIC) : 0;
+    pid_t pid = tail && !copiers_running() ? 0 : fork_child();
+
+    if (pid == 0)
+    {
+        execute_command(cmd, ctx->fds[0], ctx->fds[1]);
+    }
+    if (pid < 0)
+    {
+        shell_perror("fork");
+        return 1;
+    }
+    trace_spawn(pid, 0);
+    return wait_status(pid, 0, spawned);
+}
+
+// Runs an outermost pipeline in a cgroup of its own and records its totals
+int execute_job(Command *commands, int num_commands)
+{
+    ctx->job.active = 1;
+    ctx->job.fd = -1;
+    // The shell has to stay around to collect the totals
+    ctx->tail_exec = 0;
+
+    int status = execute_pipeline(commands, num_commands);
+    job_end(commands[0].compound != NULL ? "(compound)" : commands[0].args[0]);
+    return status;
+}
+
+int execute_pipeline(Command *commands, int num_commands)
+{
+    if (!ctx->job.active && !ctx->job.inside && cgroup_base() != NULL)
+    {
+        return execute_job(commands, num_commands);
+    }
+
+    int tail = ctx->tail_exec;
+    ctx->tail_exec = 0;
+
+    if (num_commands == 1)
+    {
+        ArenaMark mark = arena_mark(&ctx->scratch);
+        int result;
+
+        if (commands[0].compound != NULL)
+        {
+            Command cmd;
+            WordList assigns = {NULL, 0, 0};
+            SavedFds saved;
+
+            if (expand_command(&commands[0], &cmd, &assigns) != 0)
+            {
+                result = 1;
+            }
+            else if (cmd.compound->needs_fork)
+            {
+                result = execute_subshell(&cmd, tail);
+            }
+            else if (apply_redirections(&cmd, &saved) != 0)
+            {
+                result = 1;
+            }
+            else
+            {
+                ctx->tail_exec = tail;
+                result = run_compound(cmd.compound);
+                ctx->tail_exec = 0;
+                restore_redirections(&saved);
+            }
+        }
+        else
+        {
+            result = execute_simple(&commands[0], tail);
+        }
+
+        arena_release(&ctx->scratch, mark);
+        return result;
+    }
+
+    int prev_pipe_read = ctx->fds[0];
+    pid_t pids[MAX_COMMANDS];
+    long long spawned = ctx->trace.fd >= 0 ? now_us(CLOCK_MONOTONIC) : 0;
+
+    for (int i = 0; i < num_commands; i++)
+    {
+        int pipe_fd[2];
+
+        if (i < num_commands - 1)
+        {
+            // Close-on-exec keeps pipes out of children other threads fork
+            if (pipe2(pipe_fd, O_CLOEXEC) < 0)
+            {
+                shell_perror("pipe");
+                return 1;
+            }
+        }
+
+        pids[i] = fork_child();
+
+        if (pids[i] == 0)
+        {
+            int input_fd = prev_pipe_read;
+            int output_fd = (i < num_commands - 1) ? pipe_fd[1] : ctx->fds[1];
+            Command cmd;
+            WordList assigns = {NULL, 0, 0};
+
+            if (i < num_commands - 1)
+            {
+                close(pipe_fd[0]);
+            }
+
+            if (expand_command(&commands[i], &cmd, &assigns) != 0)
+            {
+                child_exit(1);
+            }
+            for (int a = 0; a < assigns.count; a++)
+            {
+                if (apply_assignment(assigns.items[a], 1) != 0)
+                {
+                    child_exit(1);
+                }
+            }
+            if (ctx->xtrace && cmd.compound == NULL)
+            {
+                xtrace_print(&assigns, cmd.args);
+            }
+            execute_command(&cmd, input_fd, output_fd);
+        }
+        else if (pids[i] < 0)
+        {
+            shell_perror("fork");
+            return 1;
+        }
+        trace_spawn(pids[i], i);
+
+        if (prev_pipe_read != ctx->fds[0])
+        {
+            close(prev_pipe_read);
+        }
+
+        if (i < num_commands - 1)
+        {
+            close(pipe_fd[1]);
+            prev_pipe_read = pipe_fd[0];
+        }
+    }
+
+    int last_status = 0;
+    for (int i = 0; i < num_commands; i++)
+    {
+        int status = wait_status(pids[i], i, spawned);
+        if (i == num_commands - 1)
+        {
+            last_status = status;
+        }
+    }
+
+    return last_status;
+}
+
+int execute(CommandList *list)
+{
+    int last_exit_status = 0;
+    int tail = ctx->tail_exec;
+
+    // Only the outermost list may hand its final command to exec
+    ctx->tail_exec = 0;
+
+    for (int g = 0; g < list->num_groups; g++)
+    {
+        CommandGroup *group = &list->groups[g];
+
+        if (group->operator == OP_AND && last_exit_status != 0)
+        {
+            continue;
+        }
+        else if (group->operator == OP_OR && last_exit_status == 0)
+        {
+            continue;
+        }
+
+        ctx->tail_exec = tail && !group->negate && g == list->num_groups - 1;
+        last_exit_status = execute_pipeline(group->commands, group->num_commands);
+        ctx->tail_exec = 0;
+        if (group->negate)
+        {
+            last_exit_status = !last_exit_status;
+        }
+        ctx->shell_status = last_exit_status;
+
+        if (ctx->pending_break > 0 || ctx->pending_continue > 0 || ctx->exiting)
+        {
+            break;
+        }
+    }
+
+    return last_exit_status;
+}
+
+unsigned long long hash64(unsigned long long hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int hash_file(const char *path, unsigned long long *hash)
+{
+    char buf[65536];
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        *hash = hash64(*hash, buf, n);
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+// Creates path and any missing parents, like mkdir -p
+int make_dirs(char *path)
+{
+    for (char *p = path + 1;; p++)
+    {
+        if (*p != '/' && *p != '\0')
+        {
+            continue;
+        }
+        char saved = *p;
+        *p = '\0';
+        int failed = mkdir(path, 0755) != 0 && errno != EEXIST;
+        *p = saved;
+        if (failed)
+        {
+            return -1;
+        }
+        if (saved == '\0')
+        {
+            return 0;
+        }
+    }
+}
+
+char *memo_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = arena_alloc(&ctx->scratch, len);
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+// $MYSHELL_MEMO_DIR, else myshell/memo under the XDG cache directory
+char *memo_dir(void)
+{
+    const char *dir = get_var("MYSHELL_MEMO_DIR");
+    const char *base = get_var("XDG_CACHE_HOME");
+    const char *home = get_var("HOME");
+
+    if (dir != NULL && *dir != '\0')
+    {
+        return arena_strndup(&ctx->scratch, dir, strlen(dir));
+    }
+    if (base != NULL && *base != '\0')
+    {
+        return memo_path(base, "myshell/memo");
+    }
+    return memo_path(home != NULL ? home : "/tmp", ".cache/myshell/memo");
+}
+
+// Everything the output may depend on: directory, argv, inputs, env
+unsigned long long memo_fingerprint(char **argv, char **inputs, int num_inputs,
+                                    char **names, int num_names, int contents)
+{
+    char cwd[PATH_MAX];
+    const char *dir = ctx->cwd != NULL ? ctx->cwd : getcwd(cwd, sizeof(cwd));
+    unsigned long long hash = hash64(14695981039346656037ULL, "memo1", 6);
+
+    hash = hash64(hash, dir != NULL ? dir : "", dir != NULL ? strlen(dir) + 1 : 1);
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        hash = hash64(hash, argv[i], strlen(argv[i]) + 1);
+    }
+
+    for (int i = 0; i < num_inputs; i++)
+    {
+        const char *path = shell_path(inputs[i]);
+        struct stat st;
+        long long stamp[3] = {-1, -1, -1};
+
+        hash = hash64(hash, inputs[i], strlen(inputs[i]) + 1);
+        if (stat(path, &st) == 0)
+        {
+            stamp[0] = st.st_size;
+            stamp[1] = st.st_mtim.tv_sec;
+            stamp[2] = st.st_mtim.tv_nsec;
+        }
+        if (contents)
+        {
+            unsigned long long content = 14695981039346656037ULL;
+            stamp[1] = hash_file(path, &content) == 0 ? (long long)content : -1;
+            stamp[2] = 0;
+        }
+        hash = hash64(hash, stamp, sizeof(stamp));
+    }
+
+    for (int i = 0; i < num_names; i++)
+    {
+        const char *value = get_var(names[i]);
+        hash = hash64(hash, names[i], strlen(names[i]) + 1);
+        hash = hash64(hash, value != NULL ? value : "", value != NULL ? strlen(value) + 1 : 0);
+    }
+    return hash;
+}
+
+// Replays a cached run; returns -1 if the entry or its objects are gone
+int memo_replay(const char *dir, const char *key)
+{
+    char out_name[32], err_name[32];
+    int status;
+    FILE *entry = fopen(memo_path(dir, key), "re");
+
+    if (entry == NULL)
+    {
+        return -1;
+    }
+    int fields = fscanf(entry, "%d %31s %31s", &status, out_name, err_name);
+    fclose(entry);
+    if (fields != 3)
+    {
+        return -1;
+    }
+
+    int fds[2] = {open(memo_path(dir, out_name), O_RDONLY | O_CLOEXEC),
+                  open(memo_path(dir, err_name), O_RDONLY | O_CLOEXEC)};
+    if (fds[0] >= 0 && fds[1] >= 0)
+    {
+        char buf[65536];
+        ssize_t n;
+
+        fflush(ctx->out);
+        fflush(ctx->err);
+        for (int i = 0; i < 2; i++)
+        {
+            while ((n = read(fds[i], buf, sizeof(buf))) > 0 &&
+                   write_all(ctx->fds[i + 1], buf, n) == 0)
+            {
+            }
+        }
+    }
+    else
+    {
+        status = -1;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+    return status;
+}
+
+// Copies both pipes to their destinations and to the capture files until
+// the command side closes them. Runs in its own process so a command
+// with a lot of output never blocks on a full pipe.
+void memo_tee(int pipes[2], int dest[2], int files[2])
+{
+    struct pollfd fds[2] = {{pipes[0], POLLIN, 0}, {pipes[1], POLLIN, 0}};
+    char buf[65536];
+    int open_pipes = 2;
+
+    while (open_pipes > 0)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+            {
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                fds[i].fd = -1;
+                open_pipes--;
+                continue;
+            }
+            write_all(dest[i], buf, n);
+            write_all(files[i], buf, n);
+        }
+    }
+}
+
+// Moves a capture file to objects named by its content and returns the name
+char *memo_store(const char *dir, const char *tmp)
+{
+    char name[32];
+    unsigned long long hash = 14695981039346656037ULL;
+
+    if (hash_file(tmp, &hash) != 0)
+    {
+        return NULL;
+    }
+    snprintf(name, sizeof(name), "objects/%016llx", hash);
+    char *path = memo_path(dir, name);
+    if (rename(tmp, path) != 0)
+    {
+        return NULL;
+    }
+    return arena_strndup(&ctx->scratch, name, strlen(name));
+}
+
+// Builds a command for execute_pipeline from words that were expanded
+// once already; they are quoted so it sees exactly the same argv
+void command_from_argv(char **argv, Command *cmd)
+{
+    int count = 0;
+    while (argv[count] != NULL)
+    {
+        count++;
+    }
+
+    memset(cmd, 0, sizeof(Command));
+    cmd->args = arena_alloc(&ctx->scratch, (count + 1) * sizeof(char *));
+    for (int i = 0; i < count; i++)
+    {
+        StrBuf word = {NULL, 0, 0};
+        sb_append_quoted(&word, argv[i]);
+        // A bare NAME=value in command position would become an assignment
+        if (i == 0 && word.data[0] != '\'' && strchr(word.data, '=') != NULL)
+        {
+            cmd->args[i] = arena_alloc(&ctx->scratch, word.len + 3);
+            snprintf(cmd->args[i], word.len + 3, "'%s'", word.data);
+        }
+        else
+        {
+            cmd->args[i] = arena_strndup(&ctx->scratch, word.data, word.len);
+        }
+        free(word.data);
+    }
+    cmd->args[count] = NULL;
 }
 
-int builtin_help(void)
+// Undoes a half-prepared memo_run
+void memo_discard(char **tmp, int *files, int *out_pipe, int *err_pipe)
 {
-    printf("\n" COLOR_CYAN "MyShell v%s - Built-in Commands\n" COLOR_RESET "\n", SHELL_VERSION);
-
-    printf(COLOR_YELLOW "Navigation & Files:\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "cd [dir]" COLOR_RESET "      Change directory (no arg = HOME)\n");
-    printf("  " COLOR_GREEN "pwd" COLOR_RESET "           Print working directory\n");
-    printf("\n");
-
-    printf(COLOR_YELLOW "Information:\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "type <cmd>" COLOR_RESET "   Show command type and location\n");
-    printf("  " COLOR_GREEN "history" COLOR_RESET "      Show command history\n");
-    printf("  " COLOR_GREEN "help" COLOR_RESET "         Show this help message\n");
-    printf("\n");
-
-    printf(COLOR_YELLOW "Output:\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "echo [text]" COLOR_RESET "  Print text to stdout\n");
-    printf("  " COLOR_GREEN "clear" COLOR_RESET "        Clear the screen\n");
-    printf("\n");
-
-    printf(COLOR_YELLOW "Shell Control:\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "exit [code]" COLOR_RESET "  Exit shell (default code: 0)\n");
-    printf("\n");
-
-    printf(COLOR_CYAN "Features:\n" COLOR_RESET);
-    printf("  • Pipes: " COLOR_GREEN "cmd1 | cmd2 | cmd3\n" COLOR_RESET);
-    printf("  • Redirects: " COLOR_GREEN "> >> < 2> 2>>\n" COLOR_RESET);
-    printf("  • Logical: " COLOR_GREEN "&& ||\n" COLOR_RESET);
-    printf("  • Quotes: " COLOR_GREEN "'single' \"double\" \\\n" COLOR_RESET);
-    printf("\n");
-
-    printf(COLOR_YELLOW "Examples:\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "ls | grep txt > files.txt\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "cat file.txt 2> errors.log\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "mkdir test && cd test && pwd\n" COLOR_RESET);
-    printf("  " COLOR_GREEN "echo 'Hello World'\n" COLOR_RESET);
-    printf("\n");
-
-    return 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (files[i] >= 0)
+        {
+            close(files[i]);
+            unlink(tmp[i]);
+        }
+        if (out_pipe[i] >= 0)
+        {
+            close(out_pipe[i]);
+        }
+        if (err_pipe[i] >= 0)
+        {
+            close(err_pipe[i]);
+        }
+    }
 }
 
-int execute_builtin(Command *cmd)
+// Runs cmd through execute_pipeline with stdout and stderr teed into
+// capture files, then records the result under key. Failures are only
+// recorded with failures set, and runs a signal cut short never are.
+// With merged, stderr shares stdout's pipe so the record keeps the order
+// of the two; it is then all replayed as stdout.
+int memo_run(const char *dir, const char *key, Command *cmd, int failures, int merged)
 {
-    char **args = cmd->args;
+    char *tmp[2] = {memo_path(dir, "objects/.out-XXXXXX"), memo_path(dir, "objects/.err-XXXXXX")};
+    int files[2] = {mkostemp(tmp[0], O_CLOEXEC), mkostemp(tmp[1], O_CLOEXEC)};
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
 
-    int saved_stdin = -1;
-    int saved_stdout = -1;
-    int saved_stderr = -1;
+    if (files[0] < 0 || files[1] < 0 || pipe2(out_pipe, O_CLOEXEC) < 0 ||
+        pipe2(err_pipe, O_CLOEXEC) < 0)
+    {
+        shell_perror("memo");
+        memo_discard(tmp, files, out_pipe, err_pipe);
+        return execute_pipeline(cmd, 1);
+    }
 
-    if (cmd->stdin_file != NULL)
+    long long spawned = ctx->trace.fd >= 0 ? now_us(CLOCK_MONOTONIC) : 0;
+    pid_t tee = fork_child();
+    if (tee == 0)
     {
-        int fd = open(cmd->stdin_file, O_RDONLY);
-        if (fd < 0)
-        {
-            perror(cmd->stdin_file);
-            return 1;
-        }
+        int pipes[2] = {out_pipe[0], err_pipe[0]};
+        int dest[2] = {ctx->fds[1], ctx->fds[2]};
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+        memo_tee(pipes, dest, files);
+        child_exit(0);
+    }
+    if (tee < 0)
+    {
+        shell_perror("fork");
+        memo_discard(tmp, files, out_pipe, err_pipe);
+        return execute_pipeline(cmd, 1);
+    }
+    trace_spawn(tee, 0);
+    close(out_pipe[0]);
+    close(err_pipe[0]);
+    close(files[0]);
+    close(files[1]);
 
-        saved_stdin = dup(STDIN_FILENO);
-        dup2(fd, STDIN_FILENO);
-        close(fd);
+    int both = merged ? fcntl(out_pipe[1], F_DUPFD_CLOEXEC, 0) : -1;
+    if (both >= 0)
+    {
+        close(err_pipe[1]);
+        err_pipe[1] = both;
     }
 
-    if (cmd->stdout_file != NULL)
+    SavedFds saved;
+    int status = 1;
+    int complete = 0;
+
+    save_fds(&saved);
+    if (replace_fd(1, out_pipe[1], &saved) != 0)
     {
-        int flags = O_WRONLY | O_CREAT;
-        flags |= cmd->stdout_append ? O_APPEND : O_TRUNC;
+        close(err_pipe[1]);
+    }
+    else if (replace_fd(2, err_pipe[1], &saved) == 0)
+    {
+        ctx->child_signaled = 0;
+        status = execute_pipeline(cmd, 1);
+        complete = !ctx->child_signaled && (status == 0 || failures);
+    }
+    restore_redirections(&saved);
+    wait_status(tee, 0, spawned);
 
-        int fd = open(cmd->stdout_file, flags, 0644);
-        if (fd < 0)
+    char *objects[2] = {NULL, NULL};
+    if (complete)
+    {
+        objects[0] = memo_store(dir, tmp[0]);
+        objects[1] = memo_store(dir, tmp[1]);
+    }
+    if (objects[0] != NULL && objects[1] != NULL)
+    {
+        char *entry = memo_path(dir, "entries/.tmp-XXXXXX");
+        int fd = mkostemp(entry, O_CLOEXEC);
+        if (fd >= 0)
         {
-            perror("open");
-            if (saved_stdin >= 0)
+            char line[128];
+            int len = snprintf(line, sizeof(line), "%d %s %s\n", status, objects[0], objects[1]);
+            if (write_all(fd, line, len) != 0 || rename(entry, memo_path(dir, key)) != 0)
             {
-                dup2(saved_stdin, STDIN_FILENO);
-                close(saved_stdin);
+                unlink(entry);
             }
-            return 1;
+            close(fd);
         }
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (objects[i] == NULL)
+        {
+            unlink(tmp[i]);
+        }
+    }
+    return status;
+}
 
-        saved_stdout = dup(STDOUT_FILENO);
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+// memo [-a] [-c] [-i file]... [-e name]... [--] command [args...]
+int builtin_memo(char **args)
+{
+    char *inputs[MAX_ARGS];
+    char *names[MAX_ARGS];
+    int num_inputs = 0;
+    int num_names = 0;
+    int contents = 0;
+    int failures = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-'; i++)
+    {
+        if (strcmp(args[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-a") == 0)
+        {
+            failures = 1;
+        }
+        else if (strcmp(args[i], "-c") == 0)
+        {
+            contents = 1;
+        }
+        else if ((strcmp(args[i], "-i") == 0 || strcmp(args[i], "-e") == 0) &&
+                 args[i + 1] != NULL && num_inputs < MAX_ARGS && num_names < MAX_ARGS)
+        {
+            if (args[i][1] == 'i')
+            {
+                inputs[num_inputs++] = args[++i];
+            }
+            else
+            {
+                names[num_names++] = args[++i];
+            }
+        }
+        else
+        {
+            fprintf(ctx->err, "memo: %s: invalid option\n", args[i]);
+            fprintf(ctx->err, "usage: memo [-a] [-c] [-i file]... [-e name]... command [args...]\n");
+            return 2;
+        }
+    }
+    if (args[i] == NULL)
+    {
+        fprintf(ctx->err, "usage: memo [-a] [-c] [-i file]... [-e name]... command [args...]\n");
+        return 2;
+    }
+    // A replay would skip the builtin's effect on the shell
+    if (builtin_changes_state(args[i]))
+    {
+        fprintf(ctx->err, "memo: %s: changes shell state, cannot be cached\n", args[i]);
+        return 2;
     }
 
-    if (cmd->stderr_file != NULL)
+    char key[40];
+    char *dir = memo_dir();
+    Command cmd;
+    struct stat out_st, err_st;
+    unsigned long long fingerprint = memo_fingerprint(&args[i], inputs, num_inputs,
+                                                      names, num_names, contents);
+
+    // stdout and stderr going to one place (2>&1, a terminal) are
+    // recorded as one stream, under a key of their own
+    int merged = ctx->fds[1] >= 0 && ctx->fds[2] >= 0 && fstat(ctx->fds[1], &out_st) == 0 &&
+                 fstat(ctx->fds[2], &err_st) == 0 && out_st.st_dev == err_st.st_dev &&
+                 out_st.st_ino == err_st.st_ino;
+    snprintf(key, sizeof(key), "entries/%016llx%s", fingerprint, merged ? "-merged" : "");
+
+    int status = memo_replay(dir, key);
+    int hit = status >= 0;
+
+    if (ctx->trace.fd >= 0)
+    {
+        trace_begin("memo");
+        trace_printf(",\"key\":\"%016llx\",\"hit\":%s", fingerprint, hit ? "true" : "false");
+        trace_end();
+    }
+    if (hit)
     {
-        int flags = O_WRONLY | O_CREAT;
-        flags |= cmd->stderr_append ? O_APPEND : O_TRUNC;
+        return status;
+    }
 
-        int fd = open(cmd->stderr_file, flags, 0644);
-        if (fd < 0)
+    command_from_argv(&args[i], &cmd);
+    if (make_dirs(memo_path(dir, "objects")) != 0 || make_dirs(memo_path(dir, "entries")) != 0)
+    {
+        shell_perror(dir);
+        return execute_pipeline(&cmd, 1);
+    }
+    return memo_run(dir, key, &cmd, failures, merged);
+}
+
+// Parses a memory size with an optional K, M or G suffix
+int parse_size(const char *text, unsigned long long *bytes)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    int shift = 0;
+
+    if (*end == 'K' || *end == 'k')
+    {
+        shift = 10;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        shift = 20;
+    }
+    else if (*end == 'G' || *end == 'g')
+    {
+        shift = 30;
+    }
+    if (shift > 0)
+    {
+        end++;
+    }
+    if (errno != 0 || end == text || *end != '\0' || value == 0 || value > (ULLONG_MAX >> shift))
+    {
+        return -1;
+    }
+    *bytes = value << shift;
+    return 0;
+}
+
+// limit [-c percent] [-m size] command: runs command as a job of its own
+// with cpu.max and memory.max set on its cgroup
+int builtin_limit(char **args)
+{
+    char cpu_max[32] = "";
+    char memory_max[32] = "";
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-'; i++)
+    {
+        char *end;
+        unsigned long long bytes;
+
+        if (strcmp(args[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-c") == 0 && args[i + 1] != NULL)
         {
-            perror("open");
-            if (saved_stdin >= 0)
+            long percent = strtol(args[++i], &end, 10);
+            if (*end != '\0' || percent <= 0 || percent > 100000)
             {
-                dup2(saved_stdin, STDIN_FILENO);
-                close(saved_stdin);
+                fprintf(ctx->err, "limit: %s: invalid cpu percentage\n", args[i]);
+                return 2;
             }
-            if (saved_stdout >= 0)
+            // Quota per 100ms period; 100 is one whole CPU
+            snprintf(cpu_max, sizeof(cpu_max), "%ld 100000", percent * 1000);
+        }
+        else if (strcmp(args[i], "-m") == 0 && args[i + 1] != NULL)
+        {
+            if (parse_size(args[++i], &bytes) != 0)
             {
-                dup2(saved_stdout, STDOUT_FILENO);
-                close(saved_stdout);
+                fprintf(ctx->err, "limit: %s: invalid memory size\n", args[i]);
+                return 2;
             }
-            return 1;
+            snprintf(memory_max, sizeof(memory_max), "%llu", bytes);
+        }
+        else
+        {
+            fprintf(ctx->err, "limit: %s: invalid option\n", args[i]);
+            fprintf(ctx->err, "usage: limit [-c percent] [-m size] command [args...]\n");
+            return 2;
         }
+    }
+    if (args[i] == NULL)
+    {
+        fprintf(ctx->err, "usage: limit [-c percent] [-m size] command [args...]\n");
+        return 2;
+    }
+    if (cgroup_base() == NULL)
+    {
+        fprintf(ctx->err, "limit: no usable cgroup (set MYSHELL_CGROUP); running without limits\n");
+    }
 
-        saved_stderr = dup(STDERR_FILENO);
-        dup2(fd, STDERR_FILENO);
-        close(fd);
+    // The command becomes a job of its own even inside another one
+    JobCgroup outer = ctx->job;
+    Command cmd;
+
+    ctx->job.active = 0;
+    ctx->job.inside = 0;
+    ctx->job.fd = -1;
+    memcpy(ctx->job.cpu_max, cpu_max, sizeof(cpu_max));
+    memcpy(ctx->job.memory_max, memory_max, sizeof(memory_max));
+
+    command_from_argv(&args[i], &cmd);
+    int status = execute_pipeline(&cmd, 1);
+    ctx->job = outer;
+    return status;
+}
+
+// Prints the resource totals of the last job run in a cgroup
+int builtin_cgstat(void)
+{
+    if (!ctx->job_stats.valid)
+    {
+        fprintf(ctx->err, "cgstat: no job has run in a cgroup\n");
+        return 1;
     }
 
-    int result = 0;
+    fprintf(ctx->out, "job %s\n", ctx->job_stats.name);
+    for (int i = 0; i < JOB_STAT_COUNT; i++)
+    {
+        if (ctx->job_stats.values[i] >= 0)
+        {
+            fprintf(ctx->out, "%s %lld\n", job_stat_fields[i].label, ctx->job_stats.values[i]);
+        }
+    }
+    return 0;
+}
 
-    if (strcmp(args[0], "exit") == 0)
+ParseCacheEntry *parse_cache_find(const char *text, size_t len, unsigned int hash)
+{
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++)
     {
-        save_history();
-        free_history();
+        ParseCacheEntry *entry = &ctx->parse_cache[i];
+        if (entry->list != NULL && entry->hash == hash && entry->len == len &&
+            memcmp(entry->text, text, len) == 0)
+        {
+            entry->last_used = ++ctx->parse_cache_clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
 
-        printf(COLOR_CYAN "\nGoodbye! 👋\n" COLOR_RESET);
+// Takes ownership of the arena holding a fresh parse of text, evicting the
+// least recently used idle entry. Returns NULL if every entry is running.
+ParseCacheEntry *parse_cache_insert(const char *text, size_t len, unsigned int hash,
+                                    Arena *arena, CommandList *list)
+{
+    ParseCacheEntry *victim = NULL;
 
-        int exit_code = 0;
-        if (args[1] != NULL)
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++)
+    {
+        ParseCacheEntry *entry = &ctx->parse_cache[i];
+        if (entry->busy == 0 && (victim == NULL || entry->last_used < victim->last_used))
         {
-            exit_code = atoi(args[1]);
+            victim = entry;
         }
-        exit(exit_code);
     }
-    else if (strcmp(args[0], "help") == 0)
+    if (victim == NULL)
     {
-        result = builtin_help();
+        return NULL;
     }
-    else if (strcmp(args[0], "clear") == 0)
+
+    arena_free(&victim->arena);
+    victim->arena = *arena;
+    arena->head = NULL;
+    victim->text = arena_strndup(&victim->arena, text, len);
+    victim->len = len;
+    victim->hash = hash;
+    victim->list = list;
+    victim->last_used = ++ctx->parse_cache_clock;
+    return victim;
+}
+
+// Parses and runs one complete chunk of input. last marks the final chunk
+// of a script, whose trailing external command may replace the shell.
+int run_program(const char *text, Arena *arena, int last)
+{
+    CommandList *list = NULL;
+    long long started = ctx->trace.fd >= 0 ? now_us(CLOCK_MONOTONIC) : 0;
+    size_t len = strlen(text);
+    unsigned int hash = hash_bytes(text, len);
+    ParseCacheEntry *entry = parse_cache_find(text, len, hash);
+    int cached = entry != NULL;
+    int status = PARSE_OK;
+
+    if (cached)
     {
-        printf("\033[2J\033[H");
-        fflush(stdout);
+        list = entry->list;
     }
-    else if (strcmp(args[0], "history") == 0)
+    else
     {
-        for (int i = 0; i < history_count; i++)
+        status = parse_program(text, arena, &list);
+        if (status == PARSE_OK && len <= PARSE_CACHE_MAX_LINE)
         {
-            printf("%4d  %s\n", i + 1, history[i]);
+            entry = parse_cache_insert(text, len, hash, arena, list);
         }
     }
-    else if (strcmp(args[0], "echo") == 0)
+
+    if (ctx->trace.fd >= 0 && status != PARSE_INCOMPLETE)
     {
-        for (int i = 1; args[i] != NULL; i++)
+        trace_begin("parse");
+        trace_string("line", text);
+        trace_printf(",\"ok\":%s,\"cached\":%s,\"parse_us\":%lld",
+                     status == PARSE_OK ? "true" : "false",
+                     cached ? "true" : "false",
+                     now_us(CLOCK_MONOTONIC) - started);
+        trace_end();
+    }
+
+    if (status == PARSE_OK)
+    {
+        if (entry != NULL)
         {
-            if (i > 1)
-            {
-                printf(" ");
-            }
-            printf("%s", args[i]);
+            entry->busy++;
+        }
+        ctx->tail_exec = last && !ctx->interactive;
+        execute(list);
+        ctx->tail_exec = 0;
+        if (entry != NULL)
+        {
+            entry->busy--;
         }
-        printf("\n");
     }
-    else if (strcmp(args[0], "pwd") == 0)
+    else if (status == PARSE_ERROR)
     {
-        char cwd[BUFFER_SIZE];
-        if (getcwd(cwd, sizeof(cwd)) != NULL)
+        ctx->shell_status = 2;
+    }
+
+    arena_free(arena);
+    return status;
+}
+
+// Sets in up to read fd. shared means commands see the same fd (the
+// shell's stdin), so its offset has to track what the shell consumed.
+int script_open(ScriptInput *in, int fd, int shared)
+{
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    char last = '\n';
+
+    memset(in, 0, sizeof(ScriptInput));
+    in->fd = fd;
+    in->mark = -1;
+    in->terminated = -1;
+
+    // A mapping has no room for a NUL after a final line without a
+    // newline that ends exactly on a page; read such files instead
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (st.st_size % page != 0 || (pread(fd, &last, 1, st.st_size - 1) == 1 && last == '\n')))
+    {
+        off_t offset = shared ? lseek(fd, 0, SEEK_CUR) : 0;
+        in->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (in->data != MAP_FAILED && offset >= 0)
         {
-            printf("%s\n", cwd);
+            madvise(in->data, st.st_size, MADV_SEQUENTIAL);
+            in->mapped = 1;
+            in->shared = shared;
+            in->len = st.st_size;
+            in->pos = offset < st.st_size ? offset : st.st_size;
+            in->eof = 1;
+            return 0;
         }
-        else
+        if (in->data != MAP_FAILED)
         {
-            perror("pwd");
-            result = 1;
+            munmap(in->data, st.st_size);
         }
     }
-    else if (strcmp(args[0], "cd") == 0)
+
+    in->cap = SCRIPT_CHUNK_SIZE;
+    in->data = malloc(in->cap);
+    if (in->data == NULL)
+    {
+        shell_perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+void script_close(ScriptInput *in)
+{
+    if (in->mapped)
+    {
+        munmap(in->data, in->len);
+    }
+    else
+    {
+        free(in->data);
+    }
+}
+
+// Reads another chunk from a pipe, first dropping everything before the
+// mark (or the read position) and growing only for very long lines
+int script_fill(ScriptInput *in)
+{
+    if (in->eof)
+    {
+        return 0;
+    }
+
+    size_t keep = in->mark >= 0 ? (size_t)in->mark : in->pos;
+    if (keep > 0)
+    {
+        memmove(in->data, in->data + keep, in->len - keep);
+        in->len -= keep;
+        in->pos -= keep;
+        in->mark = in->mark >= 0 ? in->mark - (long)keep : -1;
+        in->terminated = in->terminated >= (long)keep ? in->terminated - (long)keep : -1;
+    }
+    if (in->len + 1 >= in->cap)
+    {
+        char *grown = realloc(in->data, in->cap * 2);
+        if (grown == NULL)
+        {
+            shell_perror("realloc");
+            in->eof = 1;
+            return 0;
+        }
+        in->data = grown;
+        in->cap *= 2;
+    }
+
+    // One byte stays free for the NUL after a final unterminated line
+    ssize_t n;
+    while ((n = read(in->fd, in->data + in->len, in->cap - in->len - 1)) < 0 && errno == EINTR)
+    {
+    }
+    if (n <= 0)
+    {
+        in->eof = 1;
+        return 0;
+    }
+    in->len += n;
+    return 1;
+}
+
+// Splits off the next line in place and returns its offset, or -1 at the
+// end of input. The offset stays valid until the next script_fill.
+long script_line(ScriptInput *in)
+{
+    while (1)
+    {
+        char *newline = NULL;
+        if (in->terminated >= (long)in->pos)
+        {
+            newline = in->data + in->terminated;
+        }
+        else if (in->pos < in->len)
+        {
+            newline = memchr(in->data + in->pos, '\n', in->len - in->pos);
+        }
+
+        if (newline != NULL || (in->eof && in->pos < in->len))
+        {
+            long start = in->pos;
+            size_t end = newline != NULL ? (size_t)(newline - in->data) : in->len;
+            in->data[end] = '\0';
+            in->pos = newline != NULL ? end + 1 : end;
+            in->terminated = -1;
+            return start;
+        }
+        if (!script_fill(in) && in->pos >= in->len)
+        {
+            return -1;
+        }
+    }
+}
+
+// Whether the line just split off is the last one. Only input that is
+// already there is looked at: a pipe's next line may not be written
+// until this one has run, so there the answer is no until EOF is seen.
+int script_at_end(ScriptInput *in)
+{
+    struct pollfd pfd = {in->fd, POLLIN, 0};
+
+    while (in->pos >= in->len && !in->eof && poll(&pfd, 1, 0) > 0 && script_fill(in))
+    {
+    }
+    return in->pos >= in->len && in->eof;
+}
+
+// Parses the next line, if it is already in memory, into the parse cache
+// while a child runs, so the main loop finds it ready
+void script_prefetch(ScriptInput *in)
+{
+    if (in == NULL || in->terminated >= (long)in->pos || in->pos >= in->len)
+    {
+        return;
+    }
+
+    size_t avail = in->len - in->pos;
+    char *line = in->data + in->pos;
+    char *newline = memchr(line, '\n', avail < PARSE_CACHE_MAX_LINE ? avail : PARSE_CACHE_MAX_LINE);
+    if (newline == NULL || newline == line)
+    {
+        return;
+    }
+    *newline = '\0';
+    in->terminated = newline - in->data;
+
+    size_t len = newline - line;
+    unsigned int hash = hash_bytes(line, len);
+    if (parse_cache_find(line, len, hash) != NULL)
+    {
+        return;
+    }
+
+    Arena arena = {NULL};
+    CommandList *list;
+    ctx->prefetching = 1;
+    if (parse_program(line, &arena, &list) == PARSE_OK)
+    {
+        parse_cache_insert(line, len, hash, &arena, list);
+    }
+    ctx->prefetching = 0;
+    arena_free(&arena);
+}
+
+// Hands mapped pages that were already run back to the kernel, so a long
+// script costs the same memory as a short one
+void script_release(ScriptInput *in)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t upto = in->pos & ~(page - 1);
+
+    if (in->mapped && upto >= in->released + SCRIPT_RELEASE_SIZE)
     {
-        char *path;
+        madvise(in->data + in->released, upto - in->released, MADV_DONTNEED);
+        in->released = upto;
+    }
+}
+
+// Runs non-interactive input, parsing each line straight out of the
+// mapping or chunk buffer
+void run_script(int fd, int shared)
+{
+    ScriptInput in;
+    Arena arena = {NULL};
+
+    if (script_open(&in, fd, shared) != 0)
+    {
+        ctx->shell_status = 1;
+        return;
+    }
+    ctx->script = &in;
 
-        if (args[1] == NULL)
-        {
-            path = getenv("HOME");
-            if (path == NULL)
-            {
-                fprintf(stderr, "cd: HOME not set\n");
-                result = 1;
-                goto cleanup;
-            }
-        }
-        else if (strcmp(args[1], "~") == 0)
+    while (1)
+    {
+        long start = script_line(&in);
+        if (start < 0)
         {
-            path = getenv("HOME");
-            if (path == NULL)
+            if (in.mark >= 0)
             {
-                fprintf(stderr, "cd: HOME not set\n");
-                result = 1;
-                goto cleanup;
+                fprintf(ctx->err, "syntax error: unexpected end of file\n");
+                ctx->shell_status = 2;
             }
-        }
-        else
-        {
-            path = args[1];
+            break;
         }
 
-        if (chdir(path) != 0)
+        // Keep reading lines until the compound command is complete
+        if (in.mark >= 0)
         {
-            perror("cd");
-            result = 1;
-        }
-    }
-    else if (strcmp(args[0], "type") == 0)
-    {
-        if (args[1] == NULL)
-        {
-            fprintf(stderr, "type: missing argument\n");
-            result = 1;
-            goto cleanup;
+            in.data[start - 1] = '\n';
         }
-
-        if (is_builtin(args[1]))
+        else if (in.data[start] == '\0')
         {
-            printf("%s is a shell builtin\n", args[1]);
-            goto cleanup;
+            continue;
         }
-
-        char *path = getenv("PATH");
-        if (path == NULL)
+        else
         {
-            printf("%s: not found\n", args[1]);
-            result = 1;
-            goto cleanup;
+            in.mark = start;
         }
 
-        char *path_copy = strdup(path);
-        if (path_copy == NULL)
+        // Check for the end first so the final command can tail-exec
+        int last = script_at_end(&in);
+        if (in.shared)
         {
-            perror("strdup");
-            result = 1;
-            goto cleanup;
+            lseek(fd, in.pos, SEEK_SET);
         }
 
-        char *dir = strtok(path_copy, ":");
-        int found = 0;
+        int status = run_program(in.data + in.mark, &arena, last);
 
-        while (dir != NULL)
+        // A command that read our stdin moved the offset past what it used
+        if (in.shared)
         {
-            char full_path[BUFFER_SIZE];
-            snprintf(full_path, sizeof(full_path), "%s/%s", dir, args[1]);
-
-            if (access(full_path, X_OK) == 0)
+            off_t offset = lseek(fd, 0, SEEK_CUR);
+            if (offset >= (off_t)in.pos && offset <= (off_t)in.len)
             {
-                printf("%s is %s\n", args[1], full_path);
-                found = 1;
-                break;
+                in.pos = offset;
             }
-            dir = strtok(NULL, ":");
         }
-
-        if (!found)
+        if (status != PARSE_INCOMPLETE)
         {
-            printf("%s: not found\n", args[1]);
-            result = 1;
+            in.mark = -1;
+            script_release(&in);
         }
-
-        free(path_copy);
     }
 
-cleanup:
-    if (saved_stdin >= 0)
-    {
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdin);
-    }
+    ctx->script = NULL;
+    script_close(&in);
+}
 
-    if (saved_stdout >= 0)
+// A context on the process's own fds and directory, as the standalone
+// shell uses. NULL if out of memory.
+msh_ctx *new_context(void)
+{
+    msh_ctx *context = calloc(1, sizeof(msh_ctx));
+    if (context == NULL)
     {
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdout);
+        return NULL;
     }
 
-    if (saved_stderr >= 0)
+    context->fds[0] = STDIN_FILENO;
+    context->fds[1] = STDOUT_FILENO;
+    context->fds[2] = STDERR_FILENO;
+    for (int n = 3; n < SHELL_FD_COUNT; n++)
     {
-        dup2(saved_stderr, STDERR_FILENO);
-        close(saved_stderr);
+        context->fds[n] = -1;
     }
+    context->out = stdout;
+    context->err = stderr;
+    context->script_name = "your_program";
+    context->pid = getpid();
+    context->trace.fd = -1;
+    context->job.fd = -1;
 
-    return result;
+    msh_ctx *previous = enter_context(context);
+    init_vars();
+    ctx = previous;
+    return context;
 }
 
-void execute_command(Command *cmd, int input_fd, int output_fd)
+msh_ctx *msh_new(void)
 {
-    if (input_fd != STDIN_FILENO)
+    msh_ctx *context = new_context();
+    if (context == NULL)
     {
-        dup2(input_fd, STDIN_FILENO);
-        close(input_fd);
+        return NULL;
     }
 
-    if (output_fd != STDOUT_FILENO)
+    context->embedded = 1;
+    context->script_name = "msh";
+    context->cwd = getcwd(NULL, 0);
+    if (context->cwd == NULL)
     {
-        dup2(output_fd, STDOUT_FILENO);
-        close(output_fd);
+        msh_free(context);
+        return NULL;
     }
+    return context;
+}
 
-    if (cmd->stdin_file != NULL)
+void msh_free(msh_ctx *context)
+{
+    if (context == NULL)
     {
-        int fd = open(cmd->stdin_file, O_RDONLY);
-        if (fd < 0)
-        {
-            perror(cmd->stdin_file);
-            exit(1);
-        }
-        dup2(fd, STDIN_FILENO);
-        close(fd);
+        return;
     }
 
-    if (cmd->stdout_file != NULL)
-    {
-        int flags = O_WRONLY | O_CREAT;
-        flags |= cmd->stdout_append ? O_APPEND : O_TRUNC;
+    msh_ctx *previous = enter_context(context);
 
-        int fd = open(cmd->stdout_file, flags, 0644);
-        if (fd < 0)
-        {
-            perror("open");
-            exit(1);
-        }
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+    trace_flush();
+    if (ctx->trace.fd >= 0)
+    {
+        close(ctx->trace.fd);
     }
+    close_fds();
 
-    if (cmd->stderr_file != NULL)
+    free_history();
+    free_vars();
+    for (int i = 0; i < ctx->positional_count; i++)
     {
-        int flags = O_WRONLY | O_CREAT;
-        flags |= cmd->stderr_append ? O_APPEND : O_TRUNC;
-
-        int fd = open(cmd->stderr_file, flags, 0644);
-        if (fd < 0)
-        {
-            perror("open");
-            exit(1);
-        }
-        dup2(fd, STDERR_FILENO);
-        close(fd);
+        free(ctx->positional[i]);
+    }
+    free(ctx->positional);
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++)
+    {
+        arena_free(&ctx->parse_cache[i].arena);
     }
+    for (int i = 0; i < ARITH_CACHE_SIZE; i++)
+    {
+        arena_free(&ctx->arith_cache[i].arena);
+    }
+    arena_free(&ctx->scratch);
+    free(ctx->cwd);
+    free(ctx->cgroup_failed);
 
-    execvp(cmd->args[0], cmd->args);
-    fprintf(stderr, "%s: command not found\n", cmd->args[0]);
-    exit(127);
+    ctx = previous != context ? previous : NULL;
+    free(context);
 }
 
-int execute_pipeline(Command *commands, int num_commands)
+void msh_set_fds(msh_ctx *context, int in_fd, int out_fd, int err_fd)
 {
-    if (num_commands == 1)
-    {
-        if (is_builtin(commands[0].args[0]))
-        {
-            return execute_builtin(&commands[0]);
-        }
+    msh_ctx *previous = enter_context(context);
 
-        pid_t pid = fork();
-        if (pid == 0)
+    // Drop fds from an earlier call, then wrap private copies of the new
+    // ones so closing them never touches the caller's
+    fflush(ctx->out);
+    fflush(ctx->err);
+    for (int n = 0; n < 3; n++)
+    {
+        if (ctx->owned_fds & (1u << n))
         {
-            execute_command(&commands[0], STDIN_FILENO, STDOUT_FILENO);
+            close_slot(n);
         }
-        else if (pid > 0)
+    }
+    ctx->owned_fds &= ~7u;
+    ctx->fds[0] = in_fd;
+    ctx->fds[1] = STDOUT_FILENO;
+    ctx->fds[2] = STDERR_FILENO;
+    ctx->out = stdout;
+    ctx->err = stderr;
+    if (out_fd != STDOUT_FILENO)
+    {
+        int fd = fcntl(out_fd, F_DUPFD_CLOEXEC, 3);
+        if (fd >= 0)
         {
-            int status;
-            waitpid(pid, &status, 0);
-            if (WIFEXITED(status))
-            {
-                return WEXITSTATUS(status);
-            }
-            return 1;
+            replace_fd(1, fd, NULL);
         }
-        else
+    }
+    if (err_fd != STDERR_FILENO)
+    {
+        int fd = fcntl(err_fd, F_DUPFD_CLOEXEC, 3);
+        if (fd >= 0)
         {
-            perror("fork");
+            replace_fd(2, fd, NULL);
         }
-        return 1;
     }
 
-    int prev_pipe_read = STDIN_FILENO;
-    pid_t pids[MAX_COMMANDS];
+    ctx = previous;
+}
 
-    for (int i = 0; i < num_commands; i++)
-    {
-        int pipe_fd[2];
+const char *msh_get_var(msh_ctx *context, const char *name)
+{
+    msh_ctx *previous = enter_context(context);
+    const char *value = get_var(name);
+    ctx = previous;
+    return value;
+}
 
-        if (i < num_commands - 1)
+void msh_set_var(msh_ctx *context, const char *name, const char *value, int exported)
+{
+    msh_ctx *previous = enter_context(context);
+    set_var(name, value, exported);
+    ctx = previous;
+}
+
+// One msh_parse, msh_run or msh_exec, run through run_guarded
+typedef struct
+{
+    const char *text;
+    Arena arena;
+    CommandList *list;
+    int status;
+} ApiCall;
+
+// Puts the context back in order after an out-of-memory unwind: fds the
+// unwound commands redirected are closed and the entry ones restored
+void recover_context(SavedFds *entry)
+{
+    for (int n = 0; n < SHELL_FD_COUNT; n++)
+    {
+        unsigned int bit = 1u << n;
+        if (ctx->fds[n] != entry->fds[n] && (ctx->owned_fds & bit) && !(entry->owned & bit))
         {
-            if (pipe(pipe_fd) < 0)
-            {
-                perror("pipe");
-                return 1;
-            }
+            close_slot(n);
         }
+    }
+    memcpy(ctx->fds, entry->fds, sizeof(ctx->fds));
+    ctx->out = entry->out;
+    ctx->err = entry->err;
+    ctx->owned_fds = entry->owned;
 
-        pids[i] = fork();
+    if (ctx->job.active)
+    {
+        job_end(NULL);
+    }
+    // An entry may have been cut off half filled in; start them afresh
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++)
+    {
+        arena_free(&ctx->parse_cache[i].arena);
+        memset(&ctx->parse_cache[i], 0, sizeof(ParseCacheEntry));
+    }
+    for (int i = 0; i < ARITH_CACHE_SIZE; i++)
+    {
+        arena_free(&ctx->arith_cache[i].arena);
+        memset(&ctx->arith_cache[i], 0, sizeof(ArithCacheEntry));
+    }
+    arena_free(&ctx->scratch);
+    ctx->loop_depth = 0;
+    ctx->pending_break = 0;
+    ctx->pending_continue = 0;
+    ctx->arith_depth = 0;
+    ctx->prefetching = 0;
+    ctx->tail_exec = 0;
+    ctx->shell_status = 1;
+}
 
-        if (pids[i] == 0)
-        {
-            int input_fd = prev_pipe_read;
-            int output_fd = (i < num_commands - 1) ? pipe_fd[1] : STDOUT_FILENO;
+// Runs fn for an API call. Running out of memory unwinds back here and
+// fails the call (returning nonzero) instead of ending the host program.
+int run_guarded(void (*fn)(ApiCall *), ApiCall *call)
+{
+    jmp_buf unwind;
+    jmp_buf *outer = ctx->out_of_memory;
+    SavedFds entry;
 
-            if (i < num_commands - 1)
-            {
-                close(pipe_fd[0]);
-            }
+    save_fds(&entry);
+    ctx->out_of_memory = &unwind;
+    if (setjmp(unwind) == 0)
+    {
+        fn(call);
+        ctx->out_of_memory = outer;
+        return 0;
+    }
+    ctx->out_of_memory = outer;
+    recover_context(&entry);
+    return 1;
+}
 
-            execute_command(&commands[i], input_fd, output_fd);
-        }
-        else if (pids[i] < 0)
-        {
-            perror("fork");
-            return 1;
-        }
+void api_parse(ApiCall *call)
+{
+    call->status = parse_program(call->text, &call->arena, &call->list);
+}
 
-        if (prev_pipe_read != STDIN_FILENO)
-        {
-            close(prev_pipe_read);
-        }
+void api_run(ApiCall *call)
+{
+    execute(call->list);
+}
 
-        if (i < num_commands - 1)
-        {
-            close(pipe_fd[1]);
-            prev_pipe_read = pipe_fd[0];
-        }
+void api_exec(ApiCall *call)
+{
+    if (run_program(call->text, &call->arena, 0) == PARSE_INCOMPLETE)
+    {
+        fprintf(ctx->err, "syntax error: unexpected end of file\n");
+        ctx->shell_status = 2;
     }
+}
 
-    int last_status = 0;
-    for (int i = 0; i < num_commands; i++)
+int msh_parse(msh_ctx *context, const char *text, msh_program **out)
+{
+    msh_ctx *previous = enter_context(context);
+    msh_program *program = calloc(1, sizeof(msh_program));
+    ApiCall call = {text, {NULL}, NULL, PARSE_ERROR};
+
+    if (program == NULL)
     {
-        int status;
-        waitpid(pids[i], &status, 0);
-        if (i == num_commands - 1 && WIFEXITED(status))
-        {
-            last_status = WEXITSTATUS(status);
-        }
+        shell_perror("msh_parse");
+    }
+    else if (run_guarded(api_parse, &call) == 0 && call.status == PARSE_OK)
+    {
+        program->arena = call.arena;
+        program->list = call.list;
+        *out = program;
+    }
+    else
+    {
+        call.status = call.status == PARSE_OK ? PARSE_ERROR : call.status;
+        arena_free(&call.arena);
+        free(program);
     }
 
-    return last_status;
+    ctx = previous;
+    return call.status;
+}
+
+int msh_run(msh_ctx *context, const msh_program *program)
+{
+    msh_ctx *previous = enter_context(context);
+    ApiCall call = {NULL, {NULL}, program->list, 0};
+
+    ctx->exiting = 0;
+    run_guarded(api_run, &call);
+    fflush(ctx->out);
+    fflush(ctx->err);
+
+    int status = ctx->shell_status;
+    ctx = previous;
+    return status;
 }
 
-int execute(char **args)
+void msh_program_free(msh_program *program)
 {
-    if (args[0] == NULL)
+    if (program != NULL)
     {
-        return 0;
+        arena_free(&program->arena);
+        free(program);
+    }
+}
+
+int msh_exec(msh_ctx *context, const char *text)
+{
+    msh_ctx *previous = enter_context(context);
+    ApiCall call = {text, {NULL}, NULL, 0};
+
+    ctx->exiting = 0;
+    if (run_guarded(api_exec, &call) != 0)
+    {
+        arena_free(&call.arena);
     }
+    fflush(ctx->out);
+    fflush(ctx->err);
 
-    // Split by logical operators (&& and ||)
-    static CommandGroup groups[MAX_COMMANDS];
-    int num_groups = 0;
-    int group_start = 0;
+    int status = ctx->shell_status;
+    ctx = previous;
+    return status;
+}
 
-    groups[0].operator = OP_NONE;
+int msh_exec_capture(msh_ctx *context, const char *text, char **out, size_t *len)
+{
+    int fd = memfd_create("msh-capture", MFD_CLOEXEC);
+    FILE *capture = fd >= 0 ? fdopen(fd, "w") : NULL;
+    struct stat st;
 
-    for (int i = 0; args[i] != NULL; i++)
+    *out = NULL;
+    if (len != NULL)
+    {
+        *len = 0;
+    }
+    if (capture == NULL)
     {
-        if (strcmp(args[i], "&&") == 0)
+        fprintf(context->err, "msh_exec_capture: %s\n", strerror(errno));
+        if (fd >= 0)
         {
-            args[i] = NULL;
-            num_groups++;
-            group_start = i + 1;
-            if (num_groups < MAX_COMMANDS)
-            {
-                groups[num_groups].operator = OP_AND;
-            }
+            close(fd);
         }
-        else if (strcmp(args[i], "||") == 0)
+        return 1;
+    }
+
+    int saved_fd = context->fds[1];
+    FILE *saved_out = context->out;
+    unsigned int saved_owned = context->owned_fds;
+    context->fds[1] = fd;
+    context->out = capture;
+    context->owned_fds &= ~(1u << 1);
+
+    int status = msh_exec(context, text);
+
+    // exec may have replaced the capture stream with one of its own
+    if (context->owned_fds & (1u << 1))
+    {
+        fclose(context->out);
+    }
+    context->fds[1] = saved_fd;
+    context->out = saved_out;
+    context->owned_fds = (context->owned_fds & ~(1u << 1)) | (saved_owned & (1u << 1));
+
+    fflush(capture);
+    if (fstat(fd, &st) == 0 && (*out = malloc(st.st_size + 1)) != NULL)
+    {
+        ssize_t n = pread(fd, *out, st.st_size, 0);
+        n = n > 0 ? n : 0;
+        (*out)[n] = '\0';
+        if (len != NULL)
         {
-            args[i] = NULL;
-            num_groups++;
-            group_start = i + 1;
-            if (num_groups < MAX_COMMANDS)
-            {
-                groups[num_groups].operator = OP_OR;
-            }
+            *len = n;
         }
     }
-    num_groups++;
+    fclose(capture);
+    return status;
+}
 
-    int last_exit_status = 0;
-    group_start = 0;
+#ifndef MSH_LIBRARY
+int main(int argc, char **argv)
+{
+    char *input = NULL;
+    size_t input_size = 0;
+    StrBuf pending = {NULL, 0, 0};
+    Arena arena = {NULL};
+    int script_fd = STDIN_FILENO;
+    const char *command_string = NULL;
+    int first_arg = 1;
+
+    ctx = new_context();
+    if (ctx == NULL)
+    {
+        perror(argv[0]);
+        return 1;
+    }
 
-    for (int g = 0; g < num_groups; g++)
+    // fds 3-9 the shell was started with stay usable, as in exec 3>file
+    for (int n = 3; n < SHELL_FD_COUNT; n++)
     {
-        if (groups[g].operator == OP_AND && last_exit_status != 0)
+        if (fcntl(n, F_GETFD) >= 0)
         {
-            while (group_start < MAX_ARGS && args[group_start] != NULL)
-            {
-                group_start++;
-            }
-            group_start++;
-            continue;
+            replace_fd(n, n, NULL);
         }
-        else if (groups[g].operator == OP_OR && last_exit_status == 0)
+    }
+
+    // your_program [-c cmdline [name] | script] [args...]
+    ctx->script_name = argv[0];
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        if (argc < 3)
         {
-            while (group_start < MAX_ARGS && args[group_start] != NULL)
-            {
-                group_start++;
-            }
-            group_start++;
-            continue;
+            fprintf(ctx->err, "%s: -c: option requires an argument\n", argv[0]);
+            return 2;
         }
-
-        static Command commands[MAX_COMMANDS];
-        int num_commands = 0;
-        int arg_start = group_start;
-
-        for (int i = group_start;; i++)
+        command_string = argv[2];
+        first_arg = 3;
+        if (argc > 3)
         {
-            if (args[i] == NULL || strcmp(args[i], "|") == 0)
-            {
-                if (i > arg_start && num_commands < MAX_COMMANDS)
-                {
-                    commands[num_commands].args = &args[arg_start];
-                    if (args[i] != NULL && strcmp(args[i], "|") == 0)
-                    {
-                        args[i] = NULL;
-                    }
-                    parse_redirections(&commands[num_commands]);
-                    num_commands++;
-                    arg_start = i + 1;
-                }
-
-                if (args[i] == NULL)
-                {
-                    group_start = i + 1;
-                    break;
-                }
-            }
+            ctx->script_name = argv[3];
+            first_arg = 4;
         }
-
-        if (num_commands > 0)
+    }
+    else if (argc > 1)
+    {
+        ctx->script_name = argv[1];
+        first_arg = 2;
+        script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0)
         {
-            last_exit_status = execute_pipeline(commands, num_commands);
+            shell_perror(argv[1]);
+            return 127;
         }
     }
+    set_positional(&argv[first_arg], argc - first_arg);
 
-    return last_exit_status;
-}
+    ctx->interactive = command_string == NULL && script_fd == STDIN_FILENO && isatty(STDIN_FILENO);
 
-int main(void)
-{
-    char input[BUFFER_SIZE];
-    char **args;
-    int interactive = isatty(STDIN_FILENO);
+    if (ctx->interactive)
+    {
+        load_history();
+    }
+
+    if (get_var("MYSHELL_TRACE") != NULL && *get_var("MYSHELL_TRACE") != '\0')
+    {
+        trace_open(get_var("MYSHELL_TRACE"));
+    }
 
-    load_history();
+    if (command_string != NULL)
+    {
+        if (run_program(command_string, &arena, 1) == PARSE_INCOMPLETE)
+        {
+            fprintf(ctx->err, "syntax error: unexpected end of file\n");
+            ctx->shell_status = 2;
+        }
+        close_fds();
+        return ctx->shell_status;
+    }
 
-    if (interactive)
+    if (!ctx->interactive)
     {
-        print_banner();
+        run_script(script_fd, script_fd == STDIN_FILENO);
+        close_fds();
+        return ctx->shell_status;
     }
 
+    print_banner();
+
     while (1)
     {
-        if (interactive)
+        if (pending.len > 0)
+        {
+            fprintf(ctx->out, "> ");
+            fflush(ctx->out);
+        }
+        else
         {
             print_prompt();
         }
 
-        if (fgets(input, BUFFER_SIZE, stdin) == NULL)
+        if (getline(&input, &input_size, stdin) < 0)
         {
-            if (interactive)
+            if (pending.len > 0)
             {
-                printf("\n");
+                fprintf(ctx->err, "syntax error: unexpected end of file\n");
+                ctx->shell_status = 2;
             }
+            fprintf(ctx->out, "\n");
             break;
         }
 
         input[strcspn(input, "\n")] = '\0';
 
-        if (strlen(input) == 0)
+        if (pending.len == 0 && strlen(input) == 0)
+        {
+            continue;
+        }
+
+        char *expanded = expand_history(input);
+        if (expanded == NULL)
         {
+            ctx->shell_status = 1;
             continue;
         }
+        if (strcmp(expanded, input) != 0)
+        {
+            fprintf(ctx->out, "%s\n", expanded);
+        }
+        add_to_history(expanded);
 
-        add_to_history(input);
+        // Keep reading lines until the compound command is complete
+        if (pending.len > 0)
+        {
+            sb_putc(&pending, '\n');
+        }
+        sb_append(&pending, expanded, strlen(expanded));
+        free(expanded);
 
-        args = parse_line(input);
-        execute(args);
+        if (run_program(pending.data, &arena, 0) != PARSE_INCOMPLETE)
+        {
+            pending.len = 0;
+        }
     }
 
+    free(input);
+    free(pending.data);
     save_history();
     free_history();
 
-    return 0;
-}
\ No newline at end of file
+    close_fds();
+    return ctx->shell_status;
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef MYSHELL_H
+#define MYSHELL_H
+
+#include <stddef.h>
+
+// Embeddable shell API. Each msh_ctx holds a complete, independent shell:
+// variables, positional parameters, history, working directory, $? and
+// its stdin/stdout/stderr. Calls on one context must not overlap, but
+// separate contexts may be used from different threads at the same time.
+
+#define MSH_API __attribute__((visibility("default")))
+
+#define MSH_PARSE_OK 0
+#define MSH_PARSE_INCOMPLETE 1 // unterminated quote, if, loop, ...
+#define MSH_PARSE_ERROR 2
+
+typedef struct msh_ctx msh_ctx;
+typedef struct msh_program msh_program;
+
+// A new shell importing the process environment, using fds 0, 1 and 2
+// and starting in the process working directory. NULL if out of memory.
+MSH_API msh_ctx *msh_new(void);
+MSH_API void msh_free(msh_ctx *context);
+
+// Replaces the fds commands read from and write to. The caller keeps
+// ownership; they must stay open while the context runs commands.
+MSH_API void msh_set_fds(msh_ctx *context, int in_fd, int out_fd, int err_fd);
+
+MSH_API const char *msh_get_var(msh_ctx *context, const char *name);
+MSH_API void msh_set_var(msh_ctx *context, const char *name, const char *value, int exported);
+
+// Parses text once so it can be run repeatedly with msh_run. Returns one
+// of MSH_PARSE_*; *out is set only on MSH_PARSE_OK.
+MSH_API int msh_parse(msh_ctx *context, const char *text, msh_program **out);
+MSH_API int msh_run(msh_ctx *context, const msh_program *program);
+MSH_API void msh_program_free(msh_program *program);
+
+// Parses and runs text, returning its exit status ($?). 'exit' ends the
+// text early instead of terminating the process.
+MSH_API int msh_exec(msh_ctx *context, const char *text);
+
+// Like msh_exec, but collects everything written to stdout into a
+// NUL-terminated malloc'd buffer returned through out (length in len).
+MSH_API int msh_exec_capture(msh_ctx *context, const char *text, char **out, size_t *len);
+
+#endif